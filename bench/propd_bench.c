@@ -0,0 +1,424 @@
+/*
+ * Property service benchmark.
+ *
+ * Starts propd_server (init's property service on private paths) and
+ * drives it through libprop from a number of client threads, one
+ * scenario at a time, reporting throughput and latency percentiles:
+ *
+ *   get      property_get of preloaded keys (normally the shared area)
+ *   set      property_set of ordinary keys, every value a change
+ *   list     property_list_prefix over the preloaded keys
+ *   mix      get/set/list in the proportions given with -m
+ *   persist  property_set of persist.* keys through the journal
+ *   trigger  property_set of keys with -f property triggers each
+ *
+ * usage: propd_bench [-S server] [-t threads] [-n ops] [-k keys]
+ *                    [-f fanout] [-m get,set,list] [-s scenario,...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "properties.h"
+
+#define BENCH_TRIGGER_RC    ROOTDIR "/triggers.rc"
+#define LIST_OPS_DIVISOR    16      /* a list costs about a get per key */
+
+/*
+ * Log-linear latency histogram: 16 buckets per power of two, so any
+ * percentile is reported within about 6% of the true value.
+ */
+#define HIST_SUB_BITS   4
+#define HIST_BUCKETS    (64 << HIST_SUB_BITS)
+
+typedef struct histogram {
+    uint64_t count[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+static unsigned hist_index(uint64_t ns)
+{
+    unsigned msb;
+
+    if (ns < (1 << HIST_SUB_BITS))
+        return ns;
+    msb = 63 - __builtin_clzll(ns);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+           ((ns >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/* largest value that lands in bucket i */
+static uint64_t hist_value(unsigned i)
+{
+    unsigned shift;
+
+    if (i < (1 << HIST_SUB_BITS))
+        return i;
+    shift = (i >> HIST_SUB_BITS) - 1;
+    return ((uint64_t) ((i & ((1 << HIST_SUB_BITS) - 1)) + (1 << HIST_SUB_BITS) + 1)
+            << shift) - 1;
+}
+
+static void hist_add(Histogram *h, uint64_t ns)
+{
+    h->count[hist_index(ns)]++;
+    h->total++;
+    if (ns > h->max)
+        h->max = ns;
+}
+
+static void hist_merge(Histogram *to, const Histogram *from)
+{
+    unsigned i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        to->count[i] += from->count[i];
+    to->total += from->total;
+    if (from->max > to->max)
+        to->max = from->max;
+}
+
+static uint64_t hist_percentile(const Histogram *h, double pct)
+{
+    uint64_t want = (uint64_t) (h->total * pct / 100.0), seen = 0;
+    unsigned i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen > want)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+enum { OP_GET, OP_SET, OP_LIST, OP_PERSIST, OP_TRIGGER, OP_MIX };
+
+static const struct scenario {
+    const char *name;
+    int op;
+} scenarios[] = {
+    { "get",     OP_GET },
+    { "set",     OP_SET },
+    { "list",    OP_LIST },
+    { "mix",     OP_MIX },
+    { "persist", OP_PERSIST },
+    { "trigger", OP_TRIGGER },
+};
+
+#define SCENARIO_COUNT  (int) (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static int nthreads = 4;
+static int nops = 20000;
+static int nkeys = 256;
+static int fanout = 4;
+static int mix[3] = { 90, 9, 1 };       /* get, set, list weights */
+
+static pthread_barrier_t start_barrier;
+
+typedef struct worker {
+    pthread_t thread;
+    int id;
+    int op;
+    unsigned seed;
+    int errors;
+    Histogram hist;
+} Worker;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void count_one(const char *key, const char *value, void *cookie)
+{
+    (*(int *) cookie)++;
+}
+
+static int run_op(Worker *w, int op, int i)
+{
+    char key[PROPERTY_KEY_MAX], value[PROPERTY_VALUE_MAX];
+    int k = rand_r(&w->seed) % nkeys, n = 0, pick;
+
+    if (op == OP_MIX) {
+        pick = rand_r(&w->seed) % (mix[0] + mix[1] + mix[2]);
+        op = pick < mix[0] ? OP_GET : pick < mix[0] + mix[1] ? OP_SET : OP_LIST;
+    }
+
+    switch (op) {
+    case OP_GET:
+        snprintf(key, sizeof(key), "bench.get.%d", k);
+        return property_get(key, value, NULL) < 0 ? -1 : 0;
+    case OP_LIST:
+        return property_list_prefix("bench.get.", count_one, &n) < 0 ||
+               n < nkeys ? -1 : 0;
+    case OP_SET:
+        snprintf(key, sizeof(key), "bench.set.%d", k);
+        break;
+    case OP_PERSIST:
+        snprintf(key, sizeof(key), "persist.bench.%d", k);
+        break;
+    case OP_TRIGGER:
+        /* the two values the triggers are written for, in turn */
+        snprintf(key, sizeof(key), "bench.trig.%d", k);
+        return property_set(key, i & 1 ? "1" : "0");
+    }
+    snprintf(value, sizeof(value), "%d.%d", w->id, i);
+    return property_set(key, value);
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *w = arg;
+    uint64_t start, end;
+    int i, n = w->op == OP_LIST ? nops / LIST_OPS_DIVISOR : nops;
+
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < n; i++) {
+        start = now_ns();
+        if (run_op(w, w->op, i) < 0)
+            w->errors++;
+        end = now_ns();
+        hist_add(&w->hist, end - start);
+    }
+    return NULL;
+}
+
+static void print_usec(uint64_t ns)
+{
+    printf(" %9.2f", ns / 1000.0);
+}
+
+static int run_scenario(const struct scenario *s)
+{
+    Worker *workers;
+    Histogram total;
+    uint64_t start, elapsed;
+    int i, errors = 0;
+
+    workers = calloc(nthreads, sizeof(Worker));
+    if (workers == NULL)
+        return -1;
+    memset(&total, 0, sizeof(total));
+
+    pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++) {
+        workers[i].id = i;
+        workers[i].op = s->op;
+        workers[i].seed = i * 7919 + 1;
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+    pthread_barrier_wait(&start_barrier);
+    start = now_ns();
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        hist_merge(&total, &workers[i].hist);
+        errors += workers[i].errors;
+    }
+    elapsed = now_ns() - start;
+    pthread_barrier_destroy(&start_barrier);
+
+    printf("%-8s %7d %9llu %11.0f", s->name, nthreads,
+           (unsigned long long) total.total, total.total * 1e9 / elapsed);
+    print_usec(hist_percentile(&total, 50));
+    print_usec(hist_percentile(&total, 99));
+    print_usec(hist_percentile(&total, 99.9));
+    print_usec(total.max);
+    if (errors)
+        printf("  (%d errors)", errors);
+    printf("\n");
+    fflush(stdout);
+
+    free(workers);
+    return 0;
+}
+
+/* setting any bench.trig.N key to 0 or 1 fires fanout actions */
+static int write_trigger_rc(void)
+{
+    FILE *fp;
+    int k, v, j;
+
+    fp = fopen(BENCH_TRIGGER_RC, "w");
+    if (fp == NULL)
+        return -1;
+    for (k = 0; k < nkeys; k++) {
+        for (v = 0; v < 2; v++) {
+            for (j = 0; j < fanout; j++)
+                fprintf(fp, "on property:bench.trig.%d=%d\n    export BENCH_%d_%d 1\n\n",
+                        k, v, k, j);
+        }
+    }
+    return fclose(fp);
+}
+
+/*
+ * Remove the persistent property store left by an earlier run, so every
+ * run starts from the same empty state rather than replaying its journal.
+ */
+static void wipe_state(void)
+{
+    char path[PATH_MAX];
+    struct dirent *de;
+    DIR *dir;
+
+    dir = opendir(ROOTDIR "/property");
+    if (dir == NULL)
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", ROOTDIR "/property", de->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+static pid_t start_server(const char *server)
+{
+    char value[PROPERTY_VALUE_MAX];
+    pid_t pid;
+    int i;
+
+    pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        /* the rc parser echoes every section it reads */
+        i = open("/dev/null", O_WRONLY);
+        if (i >= 0)
+            dup2(i, STDOUT_FILENO);
+        execl(server, server, BENCH_TRIGGER_RC, (char *) NULL);
+        fprintf(stderr, "propd_bench: cannot run %s: %s\n", server, strerror(errno));
+        _exit(127);
+    }
+
+    /* wait for it to answer */
+    for (i = 0; i < 500; i++) {
+        if (property_set("bench.ready", "1") == 0 &&
+                property_get("bench.ready", value, NULL) == 1)
+            return pid;
+        usleep(10000);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static int preload(void)
+{
+    const char *keys[PROPERTY_BATCH_MAX], *values[PROPERTY_BATCH_MAX];
+    static char names[PROPERTY_BATCH_MAX][PROPERTY_KEY_MAX];
+    int k, n = 0;
+
+    for (k = 0; k < nkeys; k++) {
+        snprintf(names[n], sizeof(names[n]), "bench.get.%d", k);
+        keys[n] = names[n];
+        values[n] = "preloaded";
+        if (++n == PROPERTY_BATCH_MAX || k == nkeys - 1) {
+            if (property_set_many(n, keys, values) < 0)
+                return -1;
+            n = 0;
+        }
+    }
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: propd_bench [-S server] [-t threads] [-n ops] [-k keys]\n"
+            "                   [-f fanout] [-m get,set,list] [-s scenario,...]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    char server[4096], *only = NULL, *name;
+    const char *slash;
+    pid_t pid;
+    int c, i, status;
+
+    slash = strrchr(argv[0], '/');
+    snprintf(server, sizeof(server), "%.*spropd_server",
+             slash ? (int) (slash - argv[0] + 1) : 0, argv[0]);
+
+    while ((c = getopt(argc, argv, "S:t:n:k:f:m:s:")) != -1) {
+        switch (c) {
+        case 'S': snprintf(server, sizeof(server), "%s", optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'n': nops = atoi(optarg); break;
+        case 'k': nkeys = atoi(optarg); break;
+        case 'f': fanout = atoi(optarg); break;
+        case 'm':
+            if (sscanf(optarg, "%d,%d,%d", &mix[0], &mix[1], &mix[2]) != 3 ||
+                    mix[0] + mix[1] + mix[2] <= 0)
+                usage();
+            break;
+        case 's': only = optarg; break;
+        default: usage();
+        }
+    }
+    if (nthreads <= 0 || nops <= 0 || nkeys <= 0 || fanout < 0)
+        usage();
+
+    mkdir(ROOTDIR, 0755);
+    mkdir(ROOTDIR "/property", 0755);
+    wipe_state();
+    if (write_trigger_rc() < 0) {
+        fprintf(stderr, "propd_bench: cannot write %s\n", BENCH_TRIGGER_RC);
+        return 1;
+    }
+
+    pid = start_server(server);
+    if (pid < 0) {
+        fprintf(stderr, "propd_bench: %s did not come up\n", server);
+        return 1;
+    }
+    if (preload() < 0) {
+        fprintf(stderr, "propd_bench: cannot preload keys\n");
+        kill(pid, SIGTERM);
+        return 1;
+    }
+
+    printf("%d keys, %d ops per thread, trigger fanout %d, mix %d/%d/%d\n\n",
+           nkeys, nops, fanout, mix[0], mix[1], mix[2]);
+    printf("%-8s %7s %9s %11s %9s %9s %9s %9s  (usec)\n",
+           "scenario", "threads", "ops", "ops/s", "p50", "p99", "p99.9", "max");
+    fflush(stdout);
+
+    for (i = 0; i < SCENARIO_COUNT; i++) {
+        if (only != NULL) {
+            for (name = strstr(only, scenarios[i].name); name != NULL;
+                    name = strstr(name + 1, scenarios[i].name)) {
+                if ((name == only || name[-1] == ',') &&
+                        (name[strlen(scenarios[i].name)] == '\0' ||
+                         name[strlen(scenarios[i].name)] == ','))
+                    break;
+            }
+            if (name == NULL)
+                continue;
+        }
+        run_scenario(&scenarios[i]);
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+    return 0;
+}
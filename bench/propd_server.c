@@ -0,0 +1,101 @@
+/*
+ * Stand-in for init that runs nothing but the property service, for
+ * propd_bench.  It is built from init's own propd.c, persist.c and
+ * parser.c against the private paths in CMakeLists.txt, and serves
+ * requests exactly as init's main loop would.  Actions queued by property
+ * triggers are counted and dropped instead of executed.
+ *
+ * usage: propd_server [triggers.rc]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "init.h"
+#include "propd.h"
+#include "persist.h"
+
+static volatile sig_atomic_t stop;
+
+/* init.c services the rest of the tree provides; none are exercised here */
+void handle_control_message(const char *msg, const char *arg)
+{
+}
+
+void service_start(struct service *svc, const char *dynamic_args)
+{
+}
+
+void service_stop(struct service *svc)
+{
+}
+
+void drain_action_queue(void)
+{
+}
+
+int add_environment(const char *key, const char *val)
+{
+    return 0;
+}
+
+int add_devperms_partners(const char *name, mode_t perm, unsigned int uid,
+                          unsigned int gid, unsigned short prefix)
+{
+    return 0;
+}
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+/* only here so SIGCHLD interrupts poll and the loop reaps compactions */
+static void on_child(int sig)
+{
+}
+
+int main(int argc, char **argv)
+{
+    struct pollfd pfd;
+    unsigned long actions = 0;
+    pid_t pid;
+    int status;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, on_signal);
+    signal(SIGINT, on_signal);
+    signal(SIGCHLD, on_child);
+
+    if (argc > 1 && parse_config_file(argv[1]) < 0) {
+        fprintf(stderr, "propd_server: cannot parse %s\n", argv[1]);
+        return 1;
+    }
+
+    property_init();
+    queue_all_property_triggers();
+
+    pfd.fd = start_property_service();
+    if (pfd.fd < 0) {
+        fprintf(stderr, "propd_server: cannot start the property service\n");
+        return 1;
+    }
+    pfd.events = POLLIN;
+
+    while (!stop) {
+        while (action_remove_queue_head() != NULL)
+            actions++;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            persist_child_exited(pid, status);
+        if (poll(&pfd, 1, -1) > 0)
+            handle_property_set_fd(pfd.fd);
+    }
+
+    fprintf(stderr, "propd_server: %lu trigger actions queued\n", actions);
+    return 0;
+}
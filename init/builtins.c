@@ -36,6 +36,7 @@
 #include "init.h"
 #include "keywords.h"
 #include "devices.h"
+#include "propd.h"
 
 
 void add_environment(const char *name, const char *value);
@@ -591,6 +592,18 @@ int do_loglevel(int nargs, char **args) {
     return -1;
 }
 
+int do_load_props(int nargs, char **args) {
+    int i, result = 0;
+
+    for (i = 1; i < nargs; i++) {
+        if (property_load_file(args[i]) < 0) {
+            ERROR("cannot load properties from '%s'\n", args[i]);
+            result = -1;
+        }
+    }
+    return result;
+}
+
 int do_device(int nargs, char **args) {
     int len;
     char tmp[64];
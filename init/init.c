@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE     /* clone */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +33,9 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/reboot.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sched.h>
 #include <linux/reboot.h>
 #include <grp.h>
 #include <termios.h>
@@ -41,6 +45,7 @@
 #include "devices.h"
 #include "init.h"
 #include "propd.h"
+#include "persist.h"
 #include "bootchart.h"
 #include "path.h"
 
@@ -87,6 +92,7 @@ static void init_reboot(int sig)
 
 //    sigprocmask_allsigs(SIG_BLOCK);
     ERROR("The system is going down NOW!");
+    persist_flush();
     ERROR("Sending SIGTERM to all processes");
     system("ifdown -a --exclude=lo");
     kill(-1, SIGTERM);
@@ -207,18 +213,303 @@ static void publish_socket(const char *name, int fd)
     fcntl(fd, F_SETFD, 0);
 }
 
-void service_start(struct service *svc, const char *dynamic_args)
-{
-    struct stat s;
-    pid_t pid;
+/*
+ * Launching services without copying init's address space.
+ *
+ * spawn_service() starts the child with clone(CLONE_VM|CLONE_VFORK): it
+ * runs on a stack of its own inside init's memory while init waits, until
+ * it execs or exits.  Everything that allocates or touches init's state
+ * (sockets, environment, arguments) is therefore done here beforehand,
+ * and the child only makes system calls.  The credentials are changed
+ * with raw system calls: the libc wrappers would apply them to all of
+ * init's threads.  Signals stay blocked until the child is about to
+ * exec, so none of init's handlers ever runs in it.
+ */
+#define SPAWN_STACK_SIZE    (64 * 1024)
+#define SPAWN_MAX_FDS       31
+
+struct spawn {
+    struct service *svc;
     int needs_console;
+    char **argv;
+    const char *envp[32];
+    char *env[32];              /* entries we allocated */
+    int nenv;
+    int fds[SPAWN_MAX_FDS];
+    int nfds;
+    sigset_t mask;              /* init's mask, restored in the child */
+    int error;                  /* errno of a failed execve */
+};
+
+static void *spawn_stack;
+
+static int spawn_environment(struct spawn *sp, const char *key, const char *val)
+{
     int n;
 
+    for (n = 0; n < 31; n++) {
+        if (!sp->envp[n]) {
+            size_t len = strlen(key) + strlen(val) + 2;
+            char *entry = malloc(len);
+            if (!entry)
+                return 1;
+            snprintf(entry, len, "%s=%s", key, val);
+            sp->envp[n] = sp->env[sp->nenv++] = entry;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int spawn_child(void *arg)
+{
+    struct spawn *sp = arg;
+    struct service *svc = sp->svc;
+    struct sigaction sa;
+    int n, fd;
+
+    for (n = 1; n < _NSIG; n++) {
+        if (sigaction(n, NULL, &sa) == 0 && sa.sa_handler != SIG_DFL &&
+                sa.sa_handler != SIG_IGN) {
+            sa.sa_handler = SIG_DFL;
+            sa.sa_flags = 0;
+            sigaction(n, &sa, NULL);
+        }
+    }
+
+    for (n = 0; n < sp->nfds; n++)
+        fcntl(sp->fds[n], F_SETFD, 0);
+
+    if (sp->needs_console) {
+        setsid();
+    } else if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+        dup2(fd, 0);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        close(fd);
+    }
+
+    setpgid(0, 0);
+
+    /* as in the fork path, set our gid, supplemental gids, and uid */
+    if (svc->gid)
+        syscall(SYS_setgid, svc->gid);
+    if (svc->nr_supp_gids)
+        syscall(SYS_setgroups, svc->nr_supp_gids, svc->supp_gids);
+    if (svc->uid)
+        syscall(SYS_setuid, svc->uid);
+
+    sigprocmask(SIG_SETMASK, &sp->mask, NULL);
+    execve(sp->argv[0], sp->argv, (char**) sp->envp);
+    sp->error = errno;
+    _exit(127);
+}
+
+/*
+ * Start svc as spawn_service() describes.  Returns the child's pid, or -1
+ * if it could not be started this way and the caller should fork instead.
+ */
+static pid_t spawn_service(struct service *svc, const char *dynamic_args,
+                           int needs_console)
+{
+    struct spawn sp;
+    struct socketinfo *si;
+    struct svcenvinfo *ei;
+    char *arg_ptrs[SVC_MAXARGS+1];
+    char *tmp = NULL;
+    sigset_t all;
+    pid_t pid = -1;
+    int n;
+
+    if (!spawn_stack) {
+        spawn_stack = mmap(NULL, SPAWN_STACK_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (spawn_stack == MAP_FAILED) {
+            spawn_stack = NULL;
+            return -1;
+        }
+    }
+
+    memset(&sp, 0, sizeof(sp));
+    sp.svc = svc;
+    sp.needs_console = needs_console;
+    for (n = 0; n < 31 && ENV[n]; n++)
+        sp.envp[n] = ENV[n];
+
+    for (ei = svc->envvars; ei; ei = ei->next)
+        spawn_environment(&sp, ei->name, ei->value);
+
+    for (si = svc->sockets; si; si = si->next) {
+        char key[64] = ANDROID_SOCKET_ENV_PREFIX;
+        char val[16];
+        int s;
+
+        if (sp.nfds == SPAWN_MAX_FDS)
+            break;
+        s = create_socket(si->name,
+                          !strcmp(si->type, "dgram") ?
+                          SOCK_DGRAM : SOCK_STREAM,
+                          si->perm, si->uid, si->gid);
+        if (s < 0)
+            continue;
+        /* only the child may keep it; see spawn_child */
+        fcntl(s, F_SETFD, FD_CLOEXEC);
+        sp.fds[sp.nfds++] = s;
+        strlcpy(key + sizeof(ANDROID_SOCKET_ENV_PREFIX) - 1, si->name,
+                sizeof(key) - sizeof(ANDROID_SOCKET_ENV_PREFIX));
+        snprintf(val, sizeof(val), "%d", s);
+        spawn_environment(&sp, key, val);
+    }
+
+    if (!dynamic_args) {
+        sp.argv = svc->args;
+    } else {
+        int arg_idx = svc->nargs;
+        char *next, *bword;
+
+        tmp = next = strdup(dynamic_args);
+        if (!tmp)
+            goto out;
+        memcpy(arg_ptrs, svc->args, (svc->nargs * sizeof(char *)));
+        while ((bword = strsep(&next, " "))) {
+            arg_ptrs[arg_idx++] = bword;
+            if (arg_idx == SVC_MAXARGS)
+                break;
+        }
+        arg_ptrs[arg_idx] = 0;
+        sp.argv = arg_ptrs;
+    }
+
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, &sp.mask);
+    pid = clone(spawn_child, (char *) spawn_stack + SPAWN_STACK_SIZE,
+                CLONE_VM | CLONE_VFORK | SIGCHLD, &sp);
+    sigprocmask(SIG_SETMASK, &sp.mask, NULL);
+
+    if (pid > 0 && sp.error)
+        ERROR("cannot execve('%s'): %s\n", sp.argv[0], strerror(sp.error));
+
+out:
+    for (n = 0; n < sp.nfds; n++)
+        close(sp.fds[n]);
+    for (n = 0; n < sp.nenv; n++)
+        free(sp.env[n]);
+    free(tmp);
+    return pid;
+}
+
+static void service_launch(struct service *svc, const char *dynamic_args);
+
+/*
+ * Dependency-ordered startup (the after, requires and wants options).
+ *
+ * A service with dependencies is never launched from service_start()
+ * itself.  It pulls in what it requires or wants, then goes on the
+ * waiting list.  Once per pass of the main loop, after the action queue
+ * has run, start_waiting_services() launches every waiting service whose
+ * dependencies are met, then goes round again for those that this made
+ * ready.  So a whole class_start is seen before anything is ordered, and
+ * independent services all start in the same pass instead of in file
+ * order.  A dependency is ready once it is running, or for a oneshot once
+ * it has exited successfully.
+ */
+enum { DEP_READY, DEP_PENDING, DEP_FAILED };
+
+static int dependency_state(struct service *svc)
+{
+    if (svc->flags & SVC_DONE)
+        return DEP_READY;
+    if ((svc->flags & SVC_RUNNING) && !(svc->flags & SVC_ONESHOT))
+        return DEP_READY;
+    if (svc->flags & (SVC_RUNNING|SVC_WAITING|SVC_RESTARTING))
+        return DEP_PENDING;
+    return DEP_FAILED;
+}
+
+/* 1 if svc can start now, 0 if it must wait, -1 if a requirement failed */
+static int dependencies_met(struct service *svc)
+{
+    struct svcdep *dep;
+    int met = 1;
+
+    for (dep = svc->deps; dep; dep = dep->next) {
+        if (!dep->svc)
+            continue;
+        switch (dependency_state(dep->svc)) {
+        case DEP_PENDING:
+            met = 0;
+            break;
+        case DEP_FAILED:
+            if (dep->type == DEP_REQUIRES)
+                return -1;
+            /*
+             * A wanted service that failed is simply done without.  An
+             * after dependency that is stopped or disabled isn't being
+             * started, so there is nothing to be ordered behind; it is
+             * deliberately treated like one that doesn't exist.
+             */
+            break;
+        }
+    }
+    return met;
+}
+
+static void service_wait(struct service *svc, const char *dynamic_args)
+{
+    struct svcdep *dep;
+
+    if (svc->flags & SVC_WAITING)
+        return;
+
+    service_set_waiting(svc, 1);
+    svc->waiting_args = dynamic_args ? strdup(dynamic_args) : NULL;
+    for (dep = svc->deps; dep; dep = dep->next) {
+        if (dep->svc && dep->type != DEP_AFTER &&
+                dependency_state(dep->svc) == DEP_FAILED)
+            service_start(dep->svc, NULL);
+    }
+}
+
+static int waiting_started;
+
+static void start_if_dependencies_met(struct service *svc)
+{
+    char *args;
+    int met = dependencies_met(svc);
+
+    if (met == 0)
+        return;
+
+    service_set_waiting(svc, 0);
+    args = svc->waiting_args;
+    svc->waiting_args = NULL;
+    if (met < 0) {
+        ERROR("not starting '%s': a service it requires failed\n", svc->name);
+        notify_service_state(svc->name, "stopped");
+    } else {
+        service_launch(svc, args);
+    }
+    free(args);
+    waiting_started = 1;
+}
+
+static void start_waiting_services(void)
+{
+    do {
+        waiting_started = 0;
+        service_for_each_waiting(start_if_dependencies_met);
+    } while (waiting_started);
+}
+
+void service_start(struct service *svc, const char *dynamic_args)
+{
         /* starting a service removes it from the disabled
          * state and immediately takes it out of the restarting
          * state if it was in there
          */
-    svc->flags &= (~(SVC_DISABLED|SVC_RESTARTING));
+    svc->flags &= (~SVC_DISABLED);
+    service_set_restarting(svc, 0);
     svc->time_started = 0;
     
         /* running processes require no additional work -- if
@@ -230,6 +521,21 @@ void service_start(struct service *svc, const char *dynamic_args)
         return;
     }
 
+    if (svc->deps) {
+        service_wait(svc, dynamic_args);
+        return;
+    }
+
+    service_launch(svc, dynamic_args);
+}
+
+static void service_launch(struct service *svc, const char *dynamic_args)
+{
+    struct stat s;
+    pid_t pid;
+    int needs_console;
+    int n;
+
     needs_console = (svc->flags & SVC_CONSOLE) ? 1 : 0;
     if (needs_console && (!have_console)) {
         ERROR("service '%s' requires console\n", svc->name);
@@ -252,7 +558,9 @@ void service_start(struct service *svc, const char *dynamic_args)
 
     NOTICE("starting '%s'\n", svc->name);
 
-    pid = fork();
+    pid = spawn_service(svc, dynamic_args, needs_console);
+    if (pid < 0)
+        pid = fork();
 
     if (pid == 0) {
         struct socketinfo *si;
@@ -329,13 +637,14 @@ void service_start(struct service *svc, const char *dynamic_args)
 
     if (pid < 0) {
         ERROR("failed to start '%s'\n", svc->name);
-        svc->pid = 0;
+        service_set_pid(svc, 0);
         return;
     }
 
     svc->time_started = gettime();
-    svc->pid = pid;
+    service_set_pid(svc, pid);
     svc->flags |= SVC_RUNNING;
+    svc->flags &= (~SVC_DONE);
 
     notify_service_state(svc->name, "running");
 }
@@ -345,7 +654,13 @@ void service_stop(struct service *svc)
         /* we are no longer running, nor should we
          * attempt to restart
          */
-    svc->flags &= (~(SVC_RUNNING|SVC_RESTARTING));
+    svc->flags &= (~SVC_RUNNING);
+    service_set_restarting(svc, 0);
+    if (svc->flags & SVC_WAITING) {
+        service_set_waiting(svc, 0);
+        free(svc->waiting_args);
+        svc->waiting_args = NULL;
+    }
 
         /* if the service has not yet started, prevent
          * it from auto-starting with its class
@@ -378,6 +693,9 @@ static int wait_for_one_process(int block)
     if (pid <= 0) return -1;
     INFO("waitpid returned pid %d, status = %08x\n", pid, status);
 
+    if (persist_child_exited(pid, status))
+        return 0;
+
     svc = service_find_by_pid(pid);
     if (!svc) {
         ERROR("untracked pid %d exited\n", pid);
@@ -398,12 +716,14 @@ static int wait_for_one_process(int block)
         unlink(tmp);
     }
 
-    svc->pid = 0;
+    service_set_pid(svc, 0);
     svc->flags &= (~SVC_RUNNING);
 
         /* oneshot processes go into the disabled state on exit */
     if (svc->flags & SVC_ONESHOT) {
         svc->flags |= SVC_DISABLED;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            svc->flags |= SVC_DONE;
     }
 
         /* disabled processes do not get restarted automatically */
@@ -436,7 +756,7 @@ static int wait_for_one_process(int block)
         cmd = node_to_item(node, struct command, clist);
         cmd->func(cmd->nargs, cmd->args);
     }
-    svc->flags |= SVC_RESTARTING;
+    service_set_restarting(svc, 1);
     notify_service_state(svc->name, "restarting");
     return 0;
 }
@@ -446,7 +766,7 @@ static void restart_service_if_needed(struct service *svc)
     time_t next_start_time = svc->time_started + 5;
 
     if (next_start_time <= gettime()) {
-        svc->flags &= (~SVC_RESTARTING);
+        service_set_restarting(svc, 0);
         service_start(svc, NULL);
         return;
     }
@@ -460,8 +780,7 @@ static void restart_service_if_needed(struct service *svc)
 static void restart_processes()
 {
     process_needs_restart = 0;
-    service_for_each_flags(SVC_RESTARTING,
-                           restart_service_if_needed);
+    service_for_each_restarting(restart_service_if_needed);
 }
 
 static int signal_fd = -1;
@@ -734,6 +1053,7 @@ int main(int argc, char **argv)
     /* execute all the boot actions to get us started */
     action_for_each_trigger("early-boot", action_add_queue_tail);
     action_for_each_trigger("boot", action_add_queue_tail);
+    queue_all_property_triggers();
     drain_action_queue();
     ERROR("DONE\n");
 
@@ -756,8 +1076,18 @@ int main(int argc, char **argv)
 
         drain_action_queue();
         restart_processes();
-
-        if (process_needs_restart) {
+        start_waiting_services();
+
+        /*
+         * restarting and starting services changes init.svc.*, which
+         * can queue more actions: don't wait for the next unrelated
+         * wakeup to run them, but look at the fds before going round
+         * again, so that a trigger that keeps requeueing itself can't
+         * keep children from being reaped or properties from being set
+         */
+        if (!action_queue_empty())
+            timeout = 0;
+        else if (process_needs_restart) {
             timeout = (process_needs_restart - gettime()) * 1000;
             if (timeout < 0)
                 timeout = 0;
@@ -109,12 +109,26 @@ struct svcenvinfo {
     const char *value;
 };
 
+struct svcdep {
+    struct svcdep *next;
+    const char *name;
+    struct service *svc;    /* NULL if unknown or it would close a cycle */
+    int type;
+};
+
+/* svcdep.type */
+#define DEP_AFTER       0     /* only start after it, if it is starting */
+#define DEP_REQUIRES    1     /* start it too; don't start without it */
+#define DEP_WANTS       2     /* start it too, but start regardless */
+
 #define SVC_DISABLED    0x01  /* do not autostart with class */
 #define SVC_ONESHOT     0x02  /* do not restart on exit */
 #define SVC_RUNNING     0x04  /* currently active */
 #define SVC_RESTARTING  0x08  /* waiting to restart */
 #define SVC_CONSOLE     0x10  /* requires console */
 #define SVC_CRITICAL    0x20  /* will reboot into recovery if keeps crashing */
+#define SVC_WAITING     0x40  /* waiting for its dependencies */
+#define SVC_DONE        0x80  /* oneshot that exited successfully */
 
 #define NR_SVC_SUPP_GIDS 6    /* six supplementary groups */
 
@@ -123,6 +137,14 @@ struct svcenvinfo {
 struct service {
         /* list of all services */
     struct listnode slist;
+        /* node in the name and, while running, the pid hash chains */
+    struct listnode nlist;
+    struct listnode plist;
+        /* node in its class's members, and in the restarting list */
+    struct listnode clist;
+    struct listnode rlist;
+        /* node in the waiting list */
+    struct listnode wlist;
 
     const char *name;
     const char *classname;
@@ -141,6 +163,10 @@ struct service {
     struct socketinfo *sockets;
     struct svcenvinfo *envvars;
 
+    struct svcdep *deps;
+    char *waiting_args;     /* dynamic args to start with once ready */
+    int dep_mark;           /* cycle detection */
+
     struct action onrestart;  /* Actions to execute on restart. */
     
     /* keycodes for triggering this service via /dev/keychord */
@@ -157,18 +183,24 @@ int parse_config_file(const char *fn);
 
 struct service *service_find_by_name(const char *name);
 struct service *service_find_by_pid(pid_t pid);
+void service_set_pid(struct service *svc, pid_t pid);
 struct service *service_find_by_keychord(int keychord_id);
 void service_for_each(void (*func)(struct service *svc));
 void service_for_each_class(const char *classname,
                             void (*func)(struct service *svc));
 void service_for_each_flags(unsigned matchflags,
                             void (*func)(struct service *svc));
+void service_for_each_restarting(void (*func)(struct service *svc));
+void service_set_restarting(struct service *svc, int restarting);
+void service_for_each_waiting(void (*func)(struct service *svc));
+void service_set_waiting(struct service *svc, int waiting);
 void service_stop(struct service *svc);
 void service_start(struct service *svc, const char *dynamic_args);
 void property_changed(const char *name, const char *value);
 
 void drain_action_queue(void);
 struct action *action_remove_queue_head(void);
+int action_queue_empty(void);
 void action_add_queue_tail(struct action *act);
 void action_for_each_trigger(const char *trigger,
                              void (*func)(struct action *act));
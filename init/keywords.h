@@ -27,12 +27,14 @@ int do_chown(int nargs, char **args);
 int do_chmod(int nargs, char **args);
 int do_mknod(int nargs, char **args);
 int do_loglevel(int nargs, char **args);
+int do_load_props(int nargs, char **args);
 int do_device(int nargs, char **args);
 #define __MAKE_KEYWORD_ENUM__
 #define KEYWORD(symbol, flags, nargs, func) K_##symbol,
 enum {
     K_UNKNOWN,
 #endif
+    KEYWORD(after,       OPTION,  0, 0)
     KEYWORD(capability,  OPTION,  0, 0)
     KEYWORD(chdir,       COMMAND, 1, do_chdir)
     KEYWORD(chroot,      COMMAND, 1, do_chroot)
@@ -56,6 +58,7 @@ enum {
     KEYWORD(on,          SECTION, 0, 0)
     KEYWORD(oneshot,     OPTION,  0, 0)
     KEYWORD(onrestart,   OPTION,  0, 0)
+    KEYWORD(requires,    OPTION,  0, 0)
     KEYWORD(restart,     COMMAND, 1, do_restart)
     KEYWORD(service,     SECTION, 0, 0)
     KEYWORD(setenv,      OPTION,  2, 0)
@@ -68,12 +71,14 @@ enum {
     KEYWORD(symlink,     COMMAND, 1, do_symlink)
     KEYWORD(sysclktz,    COMMAND, 1, do_sysclktz)
     KEYWORD(user,        OPTION,  0, 0)
+    KEYWORD(wants,       OPTION,  0, 0)
     KEYWORD(write,       COMMAND, 2, do_write)
     KEYWORD(copy,        COMMAND, 2, do_copy)
     KEYWORD(chown,       COMMAND, 2, do_chown)
     KEYWORD(chmod,       COMMAND, 2, do_chmod)
     KEYWORD(mknod,       COMMAND, 5, do_mknod)
     KEYWORD(loglevel,    COMMAND, 1, do_loglevel)
+    KEYWORD(load_props,  COMMAND, 1, do_load_props)
     KEYWORD(device,      COMMAND, 4, do_device)
 #ifdef __MAKE_KEYWORD_ENUM__
     KEYWORD_COUNT,
@@ -8,12 +8,67 @@
 #include <ctype.h>
 
 #include "init.h"
+#include "propd.h"
 
 
 static list_declare(service_list);
 static list_declare(action_list);
 static list_declare(action_queue);
 
+/*
+ * "property:<name>=<value>" actions, bucketed by a hash of <name> and
+ * chained through action.tlist, so a property change only looks at the
+ * actions that can match it.
+ */
+#define PROP_TRIGGER_BUCKETS    256     /* power of two */
+#define PROP_TRIGGER_PREFIX     "property:"
+
+static struct listnode prop_triggers[PROP_TRIGGER_BUCKETS];
+static int property_triggers_enabled;
+
+/* the buckets must be valid lists before anything is parsed or queued */
+static void init_property_triggers(void)
+{
+    static int done;
+    int i;
+
+    if (done)
+        return;
+    for (i = 0; i < PROP_TRIGGER_BUCKETS; i++)
+        list_init(&prop_triggers[i]);
+    done = 1;
+}
+
+/*
+ * Services are also hashed by name, chained through service.nlist, and
+ * while running by pid, chained through service.plist, so that reaping a
+ * child or handling a start/stop doesn't walk every service.
+ */
+#define SERVICE_BUCKETS         256     /* power of two */
+
+static struct listnode service_names[SERVICE_BUCKETS];
+static struct listnode service_pids[SERVICE_BUCKETS];
+
+/*
+ * Services started while some of their dependencies aren't ready yet are
+ * chained through service.wlist until init's scheduler starts them.
+ */
+static list_declare(service_waiting);
+
+/*
+ * Class names are interned when parsed, and each class keeps its members
+ * chained through service.clist.  The services waiting to be restarted
+ * are chained through service.rlist.
+ */
+struct svcclass {
+    struct svcclass *next;
+    const char *name;
+    struct listnode members;
+};
+
+static struct svcclass *service_classes;
+static list_declare(service_restarting);
+
 #define RAW(x...) log_write(6, x)
 
 void DUMP(void)
@@ -123,6 +178,9 @@ struct {
 int lookup_keyword(const char *s)
 {
     switch (*s++) {
+    case 'a':
+        if (!strcmp(s, "fter")) return K_after;
+        break;
     case 'c':
 	if (!strcmp(s, "opy")) return K_copy;
         if (!strcmp(s, "apability")) return K_capability;
@@ -161,6 +219,7 @@ int lookup_keyword(const char *s)
         break;
     case 'l':
         if (!strcmp(s, "oglevel")) return K_loglevel;
+        if (!strcmp(s, "oad_props")) return K_load_props;
         break;
     case 'm':
         if (!strcmp(s, "kdir")) return K_mkdir;
@@ -173,6 +232,7 @@ int lookup_keyword(const char *s)
         if (!strcmp(s, "nrestart")) return K_onrestart;
         break;
     case 'r':
+        if (!strcmp(s, "equires")) return K_requires;
         if (!strcmp(s, "estart")) return K_restart;
         break;
     case 's':
@@ -193,6 +253,7 @@ int lookup_keyword(const char *s)
         if (!strcmp(s, "ser")) return K_user;
         break;
     case 'w':
+        if (!strcmp(s, "ants")) return K_wants;
         if (!strcmp(s, "rite")) return K_write;
         break;
     }
@@ -390,13 +451,63 @@ static void parse_config(const char *fn, char *s)
     }
 }
 
+static void visit_dependencies(struct service *svc)
+{
+    struct svcdep *dep;
+
+    svc->dep_mark = 1;      /* on the path being walked */
+    for (dep = svc->deps; dep; dep = dep->next) {
+        if (!dep->svc)
+            continue;
+        if (dep->svc->dep_mark == 1) {
+            ERROR("service '%s': dependency on '%s' closes a cycle, ignoring it\n",
+                  svc->name, dep->name);
+            dep->svc = 0;
+        } else if (dep->svc->dep_mark == 0) {
+            visit_dependencies(dep->svc);
+        }
+    }
+    svc->dep_mark = 2;
+}
+
+/*
+ * Point every after/requires/wants at its service, and drop the edges
+ * that close a cycle, so that what the scheduler follows is a DAG.  This
+ * is redone after each config file: a later import may define a service
+ * that an earlier one named.
+ */
+static void resolve_dependencies(void)
+{
+    struct listnode *node;
+    struct service *svc;
+    struct svcdep *dep;
+
+    list_for_each(node, &service_list) {
+        svc = node_to_item(node, struct service, slist);
+        svc->dep_mark = 0;
+        for (dep = svc->deps; dep; dep = dep->next) {
+            dep->svc = service_find_by_name(dep->name);
+            if (!dep->svc)
+                INFO("service '%s' depends on unknown service '%s'\n",
+                     svc->name, dep->name);
+        }
+    }
+    list_for_each(node, &service_list) {
+        svc = node_to_item(node, struct service, slist);
+        if (svc->dep_mark == 0)
+            visit_dependencies(svc);
+    }
+}
+
 int parse_config_file(const char *fn)
 {
     char *data;
+    init_property_triggers();
     data = read_file(fn, 0);
     if (!data) return -1;
 
     parse_config(fn, data);
+    resolve_dependencies();
     DUMP();
     return 0;
 }
@@ -415,12 +526,38 @@ static int valid_name(const char *name)
     return 1;
 }
 
+static unsigned hash_name(const char *name, size_t len)
+{
+    unsigned h = 2166136261u;
+
+    while (len--) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void service_buckets_init(void)
+{
+    int i;
+
+    if (service_names[0].next != NULL)
+        return;
+    for (i = 0; i < SERVICE_BUCKETS; i++) {
+        list_init(&service_names[i]);
+        list_init(&service_pids[i]);
+    }
+}
+
 struct service *service_find_by_name(const char *name)
 {
-    struct listnode *node;
+    struct listnode *bucket, *node;
     struct service *svc;
-    list_for_each(node, &service_list) {
-        svc = node_to_item(node, struct service, slist);
+
+    service_buckets_init();
+    bucket = &service_names[hash_name(name, strlen(name)) & (SERVICE_BUCKETS - 1)];
+    list_for_each(node, bucket) {
+        svc = node_to_item(node, struct service, nlist);
         if (!strcmp(svc->name, name)) {
             return svc;
         }
@@ -430,10 +567,13 @@ struct service *service_find_by_name(const char *name)
 
 struct service *service_find_by_pid(pid_t pid)
 {
-    struct listnode *node;
+    struct listnode *bucket, *node;
     struct service *svc;
-    list_for_each(node, &service_list) {
-        svc = node_to_item(node, struct service, slist);
+
+    service_buckets_init();
+    bucket = &service_pids[pid & (SERVICE_BUCKETS - 1)];
+    list_for_each(node, bucket) {
+        svc = node_to_item(node, struct service, plist);
         if (svc->pid == pid) {
             return svc;
         }
@@ -441,6 +581,17 @@ struct service *service_find_by_pid(pid_t pid)
     return 0;
 }
 
+/* record svc's pid, 0 once it has exited, keeping the pid index current */
+void service_set_pid(struct service *svc, pid_t pid)
+{
+    service_buckets_init();
+    if (svc->pid)
+        list_remove(&svc->plist);
+    svc->pid = pid;
+    if (pid)
+        list_add_tail(&service_pids[pid & (SERVICE_BUCKETS - 1)], &svc->plist);
+}
+
 struct service *service_find_by_keychord(int keychord_id)
 {
     struct listnode *node;
@@ -464,16 +615,104 @@ void service_for_each(void (*func)(struct service *svc))
     }
 }
 
+static struct svcclass *find_class(const char *name)
+{
+    struct svcclass *cls;
+
+    for (cls = service_classes; cls; cls = cls->next) {
+        if (!strcmp(cls->name, name))
+            return cls;
+    }
+    return 0;
+}
+
+static int service_set_class(struct service *svc, const char *name)
+{
+    struct svcclass *cls = find_class(name);
+
+    if (!cls) {
+        cls = calloc(1, sizeof(*cls));
+        if (!cls)
+            return -1;
+        cls->name = name;
+        list_init(&cls->members);
+        cls->next = service_classes;
+        service_classes = cls;
+    }
+
+    if (svc->classname)
+        list_remove(&svc->clist);
+    svc->classname = cls->name;
+    list_add_tail(&cls->members, &svc->clist);
+    return 0;
+}
+
 void service_for_each_class(const char *classname,
                             void (*func)(struct service *svc))
 {
+    struct svcclass *cls = find_class(classname);
     struct listnode *node;
     struct service *svc;
-    list_for_each(node, &service_list) {
-        svc = node_to_item(node, struct service, slist);
-        if (!strcmp(svc->classname, classname)) {
-            func(svc);
-        }
+
+    if (!cls)
+        return;
+    list_for_each(node, &cls->members) {
+        svc = node_to_item(node, struct service, clist);
+        func(svc);
+    }
+}
+
+/* set or clear SVC_RESTARTING, keeping the restarting list current */
+void service_set_restarting(struct service *svc, int restarting)
+{
+    if (!!(svc->flags & SVC_RESTARTING) == !!restarting)
+        return;
+    if (restarting) {
+        svc->flags |= SVC_RESTARTING;
+        list_add_tail(&service_restarting, &svc->rlist);
+    } else {
+        svc->flags &= (~SVC_RESTARTING);
+        list_remove(&svc->rlist);
+    }
+}
+
+/* set or clear SVC_WAITING, keeping the waiting list current */
+void service_set_waiting(struct service *svc, int waiting)
+{
+    if (!!(svc->flags & SVC_WAITING) == !!waiting)
+        return;
+    if (waiting) {
+        svc->flags |= SVC_WAITING;
+        list_add_tail(&service_waiting, &svc->wlist);
+    } else {
+        svc->flags &= (~SVC_WAITING);
+        list_remove(&svc->wlist);
+    }
+}
+
+/* func may take svc off the waiting list */
+void service_for_each_waiting(void (*func)(struct service *svc))
+{
+    struct listnode *node, *next;
+    struct service *svc;
+
+    for (node = service_waiting.next; node != &service_waiting; node = next) {
+        next = node->next;
+        svc = node_to_item(node, struct service, wlist);
+        func(svc);
+    }
+}
+
+/* func may take svc off the restarting list */
+void service_for_each_restarting(void (*func)(struct service *svc))
+{
+    struct listnode *node, *next;
+    struct service *svc;
+
+    for (node = service_restarting.next; node != &service_restarting; node = next) {
+        next = node->next;
+        svc = node_to_item(node, struct service, rlist);
+        func(svc);
     }
 }
 
@@ -503,28 +742,94 @@ void action_for_each_trigger(const char *trigger,
     }
 }
 
+static void add_property_trigger(struct action *act)
+{
+    const char *name = act->name + strlen(PROP_TRIGGER_PREFIX);
+    const char *eq = strchr(name, '=');
+
+    if (eq == NULL)
+        return;
+
+    act->hash = hash_name(name, eq - name);
+    list_add_tail(&prop_triggers[act->hash & (PROP_TRIGGER_BUCKETS - 1)],
+                  &act->tlist);
+}
+
+/* does act, a property trigger, fire for name=value? */
+static int property_trigger_matches(struct action *act, unsigned hash,
+                                    const char *name, const char *value)
+{
+    const char *test = act->name + strlen(PROP_TRIGGER_PREFIX);
+    size_t name_length = strlen(name);
+
+    if (value == NULL)
+        return 0;
+    return act->hash == hash && !strncmp(name, test, name_length) &&
+           test[name_length] == '=' &&
+           !strcmp(test + name_length + 1, value);
+}
+
 void queue_property_triggers(const char *name, const char *value)
+{
+    struct listnode *node, *bucket;
+    struct action *act;
+    unsigned hash;
+
+    if (!property_triggers_enabled)
+        return;
+
+    hash = hash_name(name, strlen(name));
+    bucket = &prop_triggers[hash & (PROP_TRIGGER_BUCKETS - 1)];
+    list_for_each(node, bucket) {
+        act = node_to_item(node, struct action, tlist);
+        if (property_trigger_matches(act, hash, name, value))
+            action_add_queue_tail(act);
+    }
+}
+
+/*
+ * Queue every property trigger that matches the current property values,
+ * and from now on have property changes queue their triggers directly.
+ */
+void queue_all_property_triggers()
 {
     struct listnode *node;
     struct action *act;
-    list_for_each(node, &action_list) {
-        act = node_to_item(node, struct action, alist);
-        if (!strncmp(act->name, "property:", strlen("property:"))) {
-            const char *test = act->name + strlen("property:");
-            int name_length = strlen(name);
-            
-            if (!strncmp(name, test, name_length) && 
-                    test[name_length] == '=' &&
-                    !strcmp(test + name_length + 1, value)) {
+    const char *name, *eq;
+    char prop_name[PROP_NAME_MAX];
+    char value[PROPERTY_LONG_VALUE_MAX];
+    int i;
+
+    init_property_triggers();
+    property_triggers_enabled = 1;
+
+    for (i = 0; i < PROP_TRIGGER_BUCKETS; i++) {
+        list_for_each(node, &prop_triggers[i]) {
+            act = node_to_item(node, struct action, tlist);
+            name = act->name + strlen(PROP_TRIGGER_PREFIX);
+            eq = strchr(name, '=');
+            if (eq - name >= PROP_NAME_MAX)
+                continue;
+            memcpy(prop_name, name, eq - name);
+            prop_name[eq - name] = 0;
+
+            if (property_get(prop_name, value, sizeof(value)) >= 0 &&
+                    property_trigger_matches(act, act->hash, prop_name, value))
                 action_add_queue_tail(act);
-            }
         }
     }
 }
 
 void action_add_queue_tail(struct action *act)
 {
-    list_add_tail(&action_queue, &act->qlist);
+    /* an action already waiting in the queue isn't queued twice */
+    if (list_empty(&act->qlist))
+        list_add_tail(&action_queue, &act->qlist);
+}
+
+int action_queue_empty(void)
+{
+    return list_empty(&action_queue);
 }
 
 struct action *action_remove_queue_head(void)
@@ -535,6 +840,7 @@ struct action *action_remove_queue_head(void)
         struct listnode *node = list_head(&action_queue);
         struct action *act = node_to_item(node, struct action, qlist);
         list_remove(node);
+        list_init(node);
         return act;
     }
 }
@@ -564,13 +870,19 @@ static void *parse_service(struct parse_state *state, int nargs, char **args)
         return 0;
     }
     svc->name = args[1];
-    svc->classname = "default";
+    if (service_set_class(svc, "default") < 0) {
+        parse_error(state, "out of memory\n");
+        free(svc);
+        return 0;
+    }
     memcpy(svc->args, args + 2, sizeof(char*) * nargs);
     svc->args[nargs] = 0;
     svc->nargs = nargs;
     svc->onrestart.name = "onrestart";
     list_init(&svc->onrestart.commands);
     list_add_tail(&service_list, &svc->slist);
+    list_add_tail(&service_names[hash_name(svc->name, strlen(svc->name)) &
+                                 (SERVICE_BUCKETS - 1)], &svc->nlist);
     return svc;
 }
 
@@ -586,13 +898,36 @@ static void parse_line_service(struct parse_state *state, int nargs, char **args
     
     kw = lookup_keyword(args[0]);
     switch (kw) {
+    case K_after:
+    case K_requires:
+    case K_wants: {
+        struct svcdep *dep;
+        if (nargs < 2) {
+            parse_error(state, "%s option requires a service name\n", args[0]);
+            break;
+        }
+        for (i = 1; i < nargs; i++) {
+            dep = calloc(1, sizeof(*dep));
+            if (!dep) {
+                parse_error(state, "out of memory\n");
+                break;
+            }
+            dep->name = args[i];
+            dep->type = kw == K_after ? DEP_AFTER :
+                        kw == K_requires ? DEP_REQUIRES : DEP_WANTS;
+            dep->next = svc->deps;
+            svc->deps = dep;
+        }
+        break;
+    }
     case K_capability:
         break;
     case K_class:
         if (nargs != 2) {
             parse_error(state, "class option requires a classname\n");
         } else {
-            svc->classname = args[1];
+            if (service_set_class(svc, args[1]) < 0)
+                parse_error(state, "out of memory\n");
         }
         break;
     case K_console:
@@ -727,8 +1062,10 @@ static void *parse_action(struct parse_state *state, int nargs, char **args)
     act = calloc(1, sizeof(*act));
     act->name = args[1];
     list_init(&act->commands);
+    list_init(&act->qlist);
     list_add_tail(&action_list, &act->alist);
-        /* XXX add to hash */
+    if (!strncmp(act->name, PROP_TRIGGER_PREFIX, strlen(PROP_TRIGGER_PREFIX)))
+        add_property_trigger(act);
     return act;
 }
 
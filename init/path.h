@@ -1,4 +1,6 @@
+#ifndef ROOTDIR     /* overridden by the benchmark build */
 #define ROOTDIR                   "/platform/"
+#endif
 #define INITRC_FILE_PATH          ROOTDIR"/init.rc"
 #define PERSISTENT_PROPERTY_DIR   ROOTDIR"/property/"
 #define PROP_PATH_SYSTEM_DEFAULT  ROOTDIR"/property/default.prop"
@@ -0,0 +1,585 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "propd.h"
+#include "persist.h"
+#include "path.h"
+
+#define JOURNAL_PATH        PERSISTENT_PROPERTY_DIR "/.journal"
+#define JOURNAL_OLD_PATH    PERSISTENT_PROPERTY_DIR "/.journal.old"
+#define SNAPSHOT_PATH       PERSISTENT_PROPERTY_DIR "/.snapshot"
+#define SNAPSHOT_TMP_PATH   PERSISTENT_PROPERTY_DIR "/.snapshot.tmp"
+
+#define PERSIST_MAGIC       0x4a525050  /* "PPRJ" */
+#define PERSIST_VERSION     1
+
+/* every journal and snapshot starts with this */
+struct persist_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+/*
+ * One update.  crc covers the rest of the header and the key and value
+ * bytes that follow it; neither is NUL terminated.
+ */
+struct persist_record {
+    uint32_t crc;
+    uint8_t  klen;
+    uint8_t  flags;
+    uint16_t vlen;
+};
+
+#define RECORD_MAX  (sizeof(struct persist_record) + PROPERTY_KEY_MAX + PROPERTY_LONG_VALUE_MAX)
+
+/*
+ * The journal itself: journal_lock is held by the writer thread for each
+ * batch it commits and by the main thread while it rotates the journal.
+ */
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static int journal_fd = -1;
+static off_t journal_size;
+
+/*
+ * Compaction starts from whichever thread is setting a property, with the
+ * store locked; the main loop reaps it.  compact_lock makes sure the pid
+ * is on record before the main loop can see the child exit.
+ */
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static pid_t compact_pid;
+
+/*
+ * Updates waiting for the writer thread, as encoded records.  Producers
+ * append under queue_lock; the writer swaps the whole buffer out.
+ */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static char *pending;
+static size_t pending_len, pending_cap;
+static int flush_requested;
+static int writing;
+static int writer_running;
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint32_t c;
+    int i, k;
+
+    if (crc_table[1] == 0) {
+        for (i = 0; i < 256; i++) {
+            c = i;
+            for (k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            crc_table[i] = c;
+        }
+    }
+
+    crc = ~crc;
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* encode key=value into buf (RECORD_MAX bytes); returns the length */
+static size_t encode_record(char *buf, const char *key, const char *value)
+{
+    struct persist_record rec;
+    size_t klen = strlen(key), vlen = strlen(value);
+
+    if (klen >= PROPERTY_KEY_MAX)
+        klen = PROPERTY_KEY_MAX - 1;
+    if (vlen >= PROPERTY_LONG_VALUE_MAX)
+        vlen = PROPERTY_LONG_VALUE_MAX - 1;
+
+    rec.klen = klen;
+    rec.flags = 0;
+    rec.vlen = vlen;
+    memcpy(buf + sizeof(rec), key, klen);
+    memcpy(buf + sizeof(rec) + klen, value, vlen);
+    rec.crc = crc32(0, (char *) &rec + sizeof(rec.crc), sizeof(rec) - sizeof(rec.crc));
+    rec.crc = crc32(rec.crc, buf + sizeof(rec), klen + vlen);
+    memcpy(buf, &rec, sizeof(rec));
+    return sizeof(rec) + klen + vlen;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Map fn and feed every intact record to setfn.  Returns the length of the
+ * valid prefix, or -1 if the file is missing or isn't one of ours.
+ */
+static off_t replay_file(const char *fn,
+                         unsigned char (*setfn)(const char *key, const char *value))
+{
+    struct persist_header hdr;
+    struct persist_record rec;
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_LONG_VALUE_MAX];
+    struct stat sb;
+    char *data;
+    off_t off;
+    int fd;
+
+    fd = open(fn, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &sb) < 0 || sb.st_size < (off_t) sizeof(hdr)) {
+        close(fd);
+        return -1;
+    }
+
+    data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        ERROR("Unable to map %s errno: %d\n", fn, errno);
+        return -1;
+    }
+
+    memcpy(&hdr, data, sizeof(hdr));
+    if (hdr.magic != PERSIST_MAGIC || hdr.version != PERSIST_VERSION) {
+        ERROR("%s is not a persistent property log\n", fn);
+        munmap(data, sb.st_size);
+        return -1;
+    }
+
+    for (off = sizeof(hdr); off + (off_t) sizeof(rec) <= sb.st_size;
+            off += sizeof(rec) + rec.klen + rec.vlen) {
+        memcpy(&rec, data + off, sizeof(rec));
+        if (rec.klen == 0 || rec.klen >= PROPERTY_KEY_MAX ||
+                rec.vlen >= PROPERTY_LONG_VALUE_MAX ||
+                off + (off_t) (sizeof(rec) + rec.klen + rec.vlen) > sb.st_size)
+            break;
+        if (crc32(crc32(0, (char *) &rec + sizeof(rec.crc), sizeof(rec) - sizeof(rec.crc)),
+                  data + off + sizeof(rec), rec.klen + rec.vlen) != rec.crc)
+            break;
+
+        memcpy(key, data + off + sizeof(rec), rec.klen);
+        key[rec.klen] = 0;
+        memcpy(value, data + off + sizeof(rec) + rec.klen, rec.vlen);
+        value[rec.vlen] = 0;
+        setfn(key, value);
+    }
+
+    if (off != sb.st_size)
+        ERROR("%s: discarding %ld bytes of torn or corrupt records\n",
+              fn, (long) (sb.st_size - off));
+
+    munmap(data, sb.st_size);
+    return off;
+}
+
+struct snapshot_writer {
+    int fd;
+    int failed;
+    size_t used;
+    char buf[32768];
+};
+
+static void snapshot_emit(const char *key, const char *value, void *cookie)
+{
+    struct snapshot_writer *w = cookie;
+
+    if (w->used + RECORD_MAX > sizeof(w->buf)) {
+        if (write_all(w->fd, w->buf, w->used) < 0)
+            w->failed = 1;
+        w->used = 0;
+    }
+    w->used += encode_record(w->buf + w->used, key, value);
+}
+
+/*
+ * Write every persist.* property into a new snapshot and move it into
+ * place.  Only uses the stack and plain system calls, so it is safe to run
+ * in a freshly forked child.
+ */
+static int write_snapshot(void)
+{
+    struct snapshot_writer w;
+    struct persist_header hdr = { PERSIST_MAGIC, PERSIST_VERSION };
+
+    w.fd = open(SNAPSHOT_TMP_PATH, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (w.fd < 0)
+        return -1;
+    w.failed = 0;
+    w.used = 0;
+
+    memcpy(w.buf, &hdr, sizeof(hdr));
+    w.used = sizeof(hdr);
+    property_foreach("persist.", snapshot_emit, &w);
+    if (write_all(w.fd, w.buf, w.used) < 0)
+        w.failed = 1;
+
+    if (fsync(w.fd) < 0)
+        w.failed = 1;
+    close(w.fd);
+
+    if (w.failed || rename(SNAPSHOT_TMP_PATH, SNAPSHOT_PATH) < 0) {
+        unlink(SNAPSHOT_TMP_PATH);
+        return -1;
+    }
+    return 0;
+}
+
+static int open_journal(int flags)
+{
+    struct persist_header hdr = { PERSIST_MAGIC, PERSIST_VERSION };
+    int fd;
+
+    fd = open(JOURNAL_PATH, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | flags, 0600);
+    if (fd < 0) {
+        ERROR("Unable to open persistent property journal errno: %d\n", errno);
+        return -1;
+    }
+
+    journal_size = lseek(fd, 0, SEEK_END);
+    if (journal_size == 0) {
+        if (write_all(fd, &hdr, sizeof(hdr)) < 0) {
+            close(fd);
+            return -1;
+        }
+        journal_size = sizeof(hdr);
+    }
+    return fd;
+}
+
+/*
+ * Synchronous compaction, used at boot and when a previous background
+ * compaction didn't finish: snapshot now, then drop both journals.
+ * Called with journal_lock held.
+ */
+static int compact_now(void)
+{
+    if (write_snapshot() < 0) {
+        ERROR("Unable to write persistent property snapshot errno: %d\n", errno);
+        return -1;
+    }
+    unlink(JOURNAL_OLD_PATH);
+    if (journal_fd >= 0)
+        close(journal_fd);
+    journal_fd = open_journal(O_TRUNC);
+    return 0;
+}
+
+/*
+ * Rotate the journal and let a child write the snapshot from its copy of
+ * the store.  Everything in the rotated journal is in that copy, and
+ * anything set after the fork lands in the new journal, which is replayed
+ * on top of the snapshot.
+ */
+static void compact_in_background(void)
+{
+    pid_t pid;
+
+    pthread_mutex_lock(&compact_lock);
+    if (compact_pid)
+        goto out;
+
+    pthread_mutex_lock(&journal_lock);
+    if (access(JOURNAL_OLD_PATH, F_OK) == 0) {
+        compact_now();
+        pthread_mutex_unlock(&journal_lock);
+        goto out;
+    }
+
+    if (rename(JOURNAL_PATH, JOURNAL_OLD_PATH) < 0) {
+        ERROR("Unable to rotate persistent property journal errno: %d\n", errno);
+        pthread_mutex_unlock(&journal_lock);
+        goto out;
+    }
+    close(journal_fd);
+    journal_fd = open_journal(O_TRUNC);
+    pthread_mutex_unlock(&journal_lock);
+
+    /* the child only uses the stack and system calls; no locks */
+    pid = fork();
+    if (pid == 0) {
+        if (write_snapshot() < 0)
+            _exit(1);
+        unlink(JOURNAL_OLD_PATH);
+        _exit(0);
+    }
+    if (pid < 0) {
+        ERROR("Unable to fork persistent property compaction\n");
+        pthread_mutex_lock(&journal_lock);
+        compact_now();
+        pthread_mutex_unlock(&journal_lock);
+        goto out;
+    }
+    compact_pid = pid;
+out:
+    pthread_mutex_unlock(&compact_lock);
+}
+
+int persist_child_exited(pid_t pid, int status)
+{
+    pthread_mutex_lock(&compact_lock);
+    if (pid == 0 || pid != compact_pid) {
+        pthread_mutex_unlock(&compact_lock);
+        return 0;
+    }
+    compact_pid = 0;
+    pthread_mutex_unlock(&compact_lock);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        ERROR("persistent property compaction failed, retrying later\n");
+    return 1;
+}
+
+/*
+ * Write-behind: commit whatever has queued up as one write and one fsync.
+ * After the first update of a batch arrives the thread waits up to
+ * PERSIST_FLUSH_MS for more, unless the batch fills or a flush is asked
+ * for, so no update stays in memory much longer than that.
+ */
+static void *writer_thread(void *arg)
+{
+    struct timespec deadline;
+    char *batch = NULL, *tmp;
+    size_t batch_len, batch_cap = 0;
+
+    pthread_mutex_lock(&queue_lock);
+    for (;;) {
+        while (pending_len == 0)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += PERSIST_FLUSH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!flush_requested && pending_len < PERSIST_BATCH_BYTES &&
+                pthread_cond_timedwait(&queue_cond, &queue_lock, &deadline) == 0)
+            ;
+
+        tmp = batch;
+        batch = pending;
+        pending = tmp;
+        batch_len = pending_len;
+        pending_len = 0;
+        pending_cap ^= batch_cap;
+        batch_cap ^= pending_cap;
+        pending_cap ^= batch_cap;
+        flush_requested = 0;
+        writing = 1;
+        pthread_mutex_unlock(&queue_lock);
+
+        pthread_mutex_lock(&journal_lock);
+        if (journal_fd >= 0) {
+            if (write_all(journal_fd, batch, batch_len) < 0 || fsync(journal_fd) < 0)
+                ERROR("Unable to commit persistent properties errno: %d\n", errno);
+            else
+                __atomic_add_fetch(&journal_size, batch_len, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&journal_lock);
+
+        pthread_mutex_lock(&queue_lock);
+        writing = 0;
+        pthread_cond_broadcast(&idle_cond);
+    }
+    return NULL;
+}
+
+static int start_writer(void)
+{
+    pthread_condattr_t attr;
+    pthread_t thread;
+    sigset_t all, old;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    /* signals are for init's main loop; the thread inherits this mask */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&thread, NULL, writer_thread, NULL) != 0) {
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        ERROR("Unable to start persistent property writer\n");
+        return -1;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_detach(thread);
+    writer_running = 1;
+    return 0;
+}
+
+void persist_write(const char *key, const char *value)
+{
+    char buf[RECORD_MAX];
+    size_t len, cap;
+    char *tmp;
+
+    if (journal_fd < 0)
+        return;
+
+    len = encode_record(buf, key, value);
+
+    if (!writer_running) {
+        pthread_mutex_lock(&journal_lock);
+        if (write_all(journal_fd, buf, len) < 0)
+            ERROR("Unable to write persistent property %s errno: %d\n", key, errno);
+        else
+            journal_size += len;
+        pthread_mutex_unlock(&journal_lock);
+    } else {
+        pthread_mutex_lock(&queue_lock);
+        if (pending_len + len > pending_cap) {
+            for (cap = pending_cap; cap < pending_len + len; )
+                cap = cap ? cap * 2 : 4096;
+            tmp = realloc(pending, cap);
+            if (tmp == NULL) {
+                pthread_mutex_unlock(&queue_lock);
+                ERROR("Unable to queue persistent property %s\n", key);
+                return;
+            }
+            pending = tmp;
+            pending_cap = cap;
+        }
+        memcpy(pending + pending_len, buf, len);
+        pending_len += len;
+        pthread_cond_signal(&queue_cond);
+        pthread_mutex_unlock(&queue_lock);
+    }
+
+    if (__atomic_load_n(&journal_size, __ATOMIC_RELAXED) > PERSIST_COMPACT_BYTES)
+        compact_in_background();
+}
+
+void persist_flush(void)
+{
+    if (!writer_running)
+        return;
+
+    pthread_mutex_lock(&queue_lock);
+    flush_requested = 1;
+    pthread_cond_signal(&queue_cond);
+    while (pending_len > 0 || writing)
+        pthread_cond_wait(&idle_cond, &queue_lock);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/*
+ * Import the old layout: one file per property, named after the key and
+ * holding the value.  Returns the number of properties imported.
+ */
+static int import_legacy_files(unsigned char (*setfn)(const char *key, const char *value))
+{
+    DIR* dir = opendir(PERSISTENT_PROPERTY_DIR);
+    struct dirent*  entry;
+    char path[PATH_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    int fd, length, count = 0;
+
+    if (!dir) {
+        ERROR("Unable to open persistent property directory %s errno: %d\n", PERSISTENT_PROPERTY_DIR, errno);
+        return 0;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp("persist.", entry->d_name, strlen("persist.")))
+            continue;
+#if HAVE_DIRENT_D_TYPE
+        if (entry->d_type != DT_REG)
+            continue;
+#endif
+        /* open the file and read the property value */
+        snprintf(path, sizeof(path), "%s/%s", PERSISTENT_PROPERTY_DIR, entry->d_name);
+        fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            length = read(fd, value, sizeof(value) - 1);
+            if (length >= 0) {
+                value[length] = 0;
+                setfn(entry->d_name, value);
+                count++;
+            } else {
+                ERROR("Unable to read persistent property file %s errno: %d\n", path, errno);
+            }
+            close(fd);
+        } else {
+            ERROR("Unable to open persistent property file %s errno: %d\n", path, errno);
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+static void remove_legacy_files(void)
+{
+    DIR* dir = opendir(PERSISTENT_PROPERTY_DIR);
+    struct dirent*  entry;
+    char path[PATH_MAX];
+
+    if (!dir)
+        return;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp("persist.", entry->d_name, strlen("persist.")))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", PERSISTENT_PROPERTY_DIR, entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+void persist_load(unsigned char (*setfn)(const char *key, const char *value))
+{
+    int imported, interrupted;
+    off_t valid;
+
+    /* legacy files predate the log, so anything logged overrides them */
+    imported = import_legacy_files(setfn);
+
+    replay_file(SNAPSHOT_PATH, setfn);
+    interrupted = replay_file(JOURNAL_OLD_PATH, setfn) >= 0;
+    valid = replay_file(JOURNAL_PATH, setfn);
+
+    /* cut off a torn tail so new records follow the last good one */
+    if (valid > 0)
+        truncate(JOURNAL_PATH, valid);
+    else
+        unlink(JOURNAL_PATH);
+
+    journal_fd = open_journal(0);
+
+    /* the legacy files go only once their values are safely logged */
+    pthread_mutex_lock(&journal_lock);
+    if ((imported || interrupted) && compact_now() == 0 && imported)
+        remove_legacy_files();
+    pthread_mutex_unlock(&journal_lock);
+
+    start_writer();
+}
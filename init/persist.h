@@ -0,0 +1,34 @@
+#ifndef _INIT_PERSIST_H
+#define _INIT_PERSIST_H
+
+#include <sys/types.h>
+
+/*
+ * Log-structured store for persist.* properties.
+ *
+ * Updates are appended to a journal of checksummed records by a
+ * write-behind thread, which commits them in groups with a single fsync
+ * at most PERSIST_FLUSH_MS after they were queued.  Once the journal
+ * grows past PERSIST_COMPACT_BYTES it is rotated and a forked child
+ * rewrites the full set of persist.* properties into a snapshot.
+ * At boot the snapshot and journal are each mapped once and replayed.
+ * Legacy one-file-per-property layouts are imported and then removed.
+ */
+
+#define PERSIST_COMPACT_BYTES   (64 * 1024)
+#define PERSIST_FLUSH_MS        100
+#define PERSIST_BATCH_BYTES     (16 * 1024)  /* commit early past this */
+
+/* replay everything on disk through setfn; call once at boot */
+void persist_load(unsigned char (*setfn)(const char *key, const char *value));
+
+/* queue one update for the journal */
+void persist_write(const char *key, const char *value);
+
+/* block until every queued update is on disk */
+void persist_flush(void);
+
+/* returns 1 if pid was a compaction child (and is now reaped) */
+int persist_child_exited(pid_t pid, int status);
+
+#endif /* _INIT_PERSIST_H */
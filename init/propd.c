@@ -4,6 +4,7 @@
 // Property sever.  Mimics behavior provided on the device by init(8) and
 // some code built into libc.
 
+#define _GNU_SOURCE
 #define NELEM(x) ((int) (sizeof(x) / sizeof((x)[0])))
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,9 +21,17 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "propd.h"
+#include "prop_ring.h"
+#include "persist.h"
 #include "path.h"
 
 static int persistent_properties_loaded = 0;
@@ -32,403 +41,2406 @@ static int persistent_properties_loaded = 0;
 #define false (0)
 #endif
 
-static list_declare(prop_list);
+static prop_area *pa;
 
+/*
+ * Create the shared property area.  A previous instance of the file is
+ * flagged stale first so that clients still mapping it know to remap.
+ */
+static int init_property_area(void)
+{
+    struct stat sb;
+    prop_area *old;
+    int fd;
+
+    fd = open(SYSTEM_PROPERTY_AREA_NAME, O_RDWR | O_NOFOLLOW);
+    if (fd >= 0) {
+        if (fstat(fd, &sb) == 0 && sb.st_size == sizeof(prop_area)) {
+            old = mmap(NULL, sizeof(prop_area), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+            if (old != MAP_FAILED) {
+                __atomic_store_n(&old->stale, 1, __ATOMIC_RELEASE);
+                munmap(old, sizeof(prop_area));
+            }
+        }
+        close(fd);
+    }
+    unlink(SYSTEM_PROPERTY_AREA_NAME);
+
+    fd = open(SYSTEM_PROPERTY_AREA_NAME,
+              O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+    if (fd < 0) {
+        ERROR("Unable to create property area %s errno: %d\n",
+              SYSTEM_PROPERTY_AREA_NAME, errno);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    if (ftruncate(fd, sizeof(prop_area)) < 0) {
+        ERROR("Unable to size property area errno: %d\n", errno);
+        close(fd);
+        return -1;
+    }
+
+    pa = mmap(NULL, sizeof(prop_area), PROT_READ | PROT_WRITE,
+              MAP_SHARED, fd, 0);
+    close(fd);
+    if (pa == MAP_FAILED) {
+        ERROR("Unable to map property area errno: %d\n", errno);
+        pa = NULL;
+        return -1;
+    }
+
+    pa->version = PA_VERSION;
+    __atomic_store_n(&pa->magic, PA_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Find the slot for key, handing out a new one if it has never been
+ * published.  Returns NULL (and marks the area as overflowed, which sends
+ * readers back to the socket on a miss) when there is no room left.
+ */
+static prop_info *area_find_or_alloc(const char *key)
+{
+    unsigned mask = PA_INDEX_SIZE - 1;
+    unsigned i, n;
+    prop_info *pi;
+
+    if (pa == NULL)
+        return NULL;
+
+    for (i = pa_hash(key) & mask, n = 0; n < PA_INDEX_SIZE; i = (i + 1) & mask, n++) {
+        if (pa->index[i] == 0)
+            break;
+        pi = &pa->info[pa->index[i] - 1];
+        if (strcmp(pi->name, key) == 0)
+            return pi;
+    }
+
+    if (n == PA_INDEX_SIZE || pa->count == PA_COUNT_MAX) {
+        if (!pa->overflow)
+            ERROR("property area full at %u properties: '%s' and any later "
+                  "new key, and every lookup of a missing key, now go over "
+                  "the socket\n", pa->count, key);
+        __atomic_store_n(&pa->overflow, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    pi = &pa->info[pa->count];
+    strlcpy(pi->name, key, sizeof(pi->name));
+    pi->flags = PI_DELETED;
+
+    /* name must be visible before the slot is reachable from the index */
+    __atomic_store_n(&pa->index[i], pa->count + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&pa->count, pa->count + 1, __ATOMIC_RELEASE);
+    return pi;
+}
+
+/*
+ * Publish a new value for pi; a NULL value removes the property.  A key
+ * that has no slot still moves the area's serial, which is what clients
+ * check their cached copies of such keys against.
+ */
+static void area_write(prop_info *pi, const char *value)
+{
+    uint32_t serial;
+
+    if (pa == NULL)
+        return;
+    if (pi == NULL) {
+        __atomic_add_fetch(&pa->serial, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    serial = pi->serial;
+    __atomic_store_n(&pi->serial, serial + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (value != NULL) {
+        if (strlcpy(pi->value, value, sizeof(pi->value)) >= sizeof(pi->value))
+            pi->flags |= PI_LONG;
+        else
+            pi->flags &= ~PI_LONG;
+        pi->flags &= ~PI_DELETED;
+    } else {
+        pi->value[0] = 0;
+        pi->flags = (pi->flags & ~PI_LONG) | PI_DELETED;
+    }
+
+    __atomic_store_n(&pi->serial, serial + 2, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&pa->serial, 1, __ATOMIC_RELEASE);
+}
+
+/* bracket the area writes of a commit; see prop_area.h */
+static void area_commit_begin(void)
+{
+    if (pa == NULL)
+        return;
+    __atomic_store_n(&pa->commit, pa->commit + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void area_commit_end(void)
+{
+    if (pa == NULL)
+        return;
+    __atomic_store_n(&pa->commit, pa->commit + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * The property store.  Records come from a slab and are indexed by an
+ * open-addressing hash table (linear probing, tombstones on delete) for
+ * get/set, and by a crit-bit tree for ordered and prefix listing.
+ */
+#define PROP_SLAB_COUNT     64
+#define PROP_HASH_MIN       128     /* power of two */
+#define PROP_TOMBSTONE      ((Property *) 1)
+
+static Property **prop_hash;
+static unsigned prop_hash_size;
+static unsigned prop_hash_used;     /* live entries plus tombstones */
+static unsigned prop_count;
+
+static list_declare(prop_free_list);
+
+static Property *prop_alloc(void)
+{
+    struct listnode *node;
+    Property *slab;
+    int i;
+
+    if (list_empty(&prop_free_list)) {
+        slab = calloc(PROP_SLAB_COUNT, sizeof(Property));
+        if (slab == NULL)
+            return NULL;
+        for (i = 0; i < PROP_SLAB_COUNT; i++)
+            list_add_tail(&prop_free_list, &slab[i].plist);
+    }
+
+    node = list_head(&prop_free_list);
+    list_remove(node);
+    return node_to_item(node, Property, plist);
+}
+
+static void prop_release(Property *prop)
+{
+    free(prop->long_value);
+    prop->long_value = NULL;
+    list_add_tail(&prop_free_list, &prop->plist);
+}
+
+/*
+ * Values up to PROPERTY_VALUE_MAX - 1 bytes live in the record itself.
+ * Longer ones (only v2 clients can send them) are kept in a separate
+ * allocation, with value holding the prefix that v1 clients, listings
+ * and notifications see.
+ */
+static const char *prop_value(const Property *prop)
+{
+    return prop->long_value ? prop->long_value : prop->value;
+}
+
+/* returns the table position holding key, or -1 */
+static int prop_hash_find(const char *key, unsigned hash)
+{
+    unsigned mask = prop_hash_size - 1;
+    unsigned i;
+    Property *prop;
+
+    if (prop_hash == NULL)
+        return -1;
+
+    for (i = hash & mask; (prop = prop_hash[i]) != NULL; i = (i + 1) & mask) {
+        if (prop != PROP_TOMBSTONE && prop->hash == hash &&
+                strcmp(prop->key, key) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void prop_hash_place(Property *prop)
+{
+    unsigned mask = prop_hash_size - 1;
+    unsigned i;
+
+    for (i = prop->hash & mask; prop_hash[i] != NULL; i = (i + 1) & mask) {
+        if (prop_hash[i] == PROP_TOMBSTONE)
+            break;
+    }
+    if (prop_hash[i] == NULL)
+        prop_hash_used++;
+    prop_hash[i] = prop;
+}
+
+static int prop_hash_resize(unsigned size)
+{
+    Property **old = prop_hash;
+    unsigned old_size = prop_hash_size;
+    unsigned i;
+
+    prop_hash = calloc(size, sizeof(Property *));
+    if (prop_hash == NULL) {
+        prop_hash = old;
+        return -1;
+    }
+    prop_hash_size = size;
+    prop_hash_used = 0;
+
+    for (i = 0; i < old_size; i++) {
+        if (old[i] != NULL && old[i] != PROP_TOMBSTONE)
+            prop_hash_place(old[i]);
+    }
+    free(old);
+    return 0;
+}
+
+static int prop_hash_insert(Property *prop)
+{
+    unsigned size;
+
+    /*
+     * Rebuild once live entries plus tombstones pass 3/4, sized so that
+     * the live entries alone fill at most half of the new table.
+     */
+    if (prop_hash == NULL || (prop_hash_used + 1) * 4 > prop_hash_size * 3) {
+        for (size = PROP_HASH_MIN; (prop_count + 1) * 2 > size; size *= 2)
+            ;
+        if (prop_hash_resize(size) < 0)
+            return -1;
+    }
+
+    prop_hash_place(prop);
+    prop_count++;
+    return 0;
+}
+
+/*
+ * Make room for count more properties, so that inserting them can't
+ * fail or rehash as they arrive.
+ */
+static int prop_hash_reserve(unsigned count)
+{
+    unsigned size;
+
+    if (prop_hash != NULL && (prop_hash_used + count) * 4 <= prop_hash_size * 3)
+        return 0;
+    for (size = PROP_HASH_MIN; (prop_count + count) * 2 > size; size *= 2)
+        ;
+    return prop_hash_resize(size);
+}
+
+
+/*
+ * Ordered index: a crit-bit tree over the keys.  Each internal node
+ * records the byte, and the bit within it, at which the keys below its
+ * two children first differ; the leaves are the Property records
+ * themselves, told apart from nodes by the low bit of the pointer.  A
+ * prefix scan descends to the smallest subtree holding every key with
+ * that prefix and walks only that, in key order.
+ */
+typedef struct prop_tree_node {
+    void *child[2];
+    unsigned byte;
+    unsigned char otherbits;    /* every bit but the critical one set */
+} PropTreeNode;
+
+#define TREE_IS_NODE(p)     ((uintptr_t) (p) & 1)
+#define TREE_NODE(p)        ((PropTreeNode *) ((uintptr_t) (p) - 1))
+
+static void *prop_tree;
+
+static int tree_direction(const PropTreeNode *q, const char *key, size_t len)
+{
+    unsigned char c = q->byte < len ? key[q->byte] : 0;
+
+    return (1 + (q->otherbits | c)) >> 8;
+}
+
+static int prop_tree_insert(Property *prop)
+{
+    const unsigned char *key = (const unsigned char *) prop->key;
+    const unsigned char *best;
+    size_t len = strlen(prop->key);
+    unsigned byte, otherbits;
+    PropTreeNode *q, *node;
+    void *p, **wherep;
+    int direction;
+
+    if (prop_tree == NULL) {
+        prop_tree = prop;
+        return 0;
+    }
+
+    /* find the closest existing key and where it first differs */
+    for (p = prop_tree; TREE_IS_NODE(p); ) {
+        q = TREE_NODE(p);
+        p = q->child[tree_direction(q, prop->key, len)];
+    }
+    best = (const unsigned char *) ((Property *) p)->key;
+
+    for (byte = 0; byte < len && best[byte] == key[byte]; byte++)
+        ;
+    otherbits = best[byte] ^ key[byte];
+    if (otherbits == 0)
+        return 0;
+    otherbits |= otherbits >> 1;
+    otherbits |= otherbits >> 2;
+    otherbits |= otherbits >> 4;
+    otherbits = (otherbits & ~(otherbits >> 1)) ^ 255;
+    direction = (1 + (otherbits | best[byte])) >> 8;
+
+    node = malloc(sizeof(*node));
+    if (node == NULL)
+        return -1;
+    node->byte = byte;
+    node->otherbits = otherbits;
+    node->child[1 - direction] = prop;
+
+    for (wherep = &prop_tree; TREE_IS_NODE(*wherep); ) {
+        q = TREE_NODE(*wherep);
+        if (q->byte > byte || (q->byte == byte && q->otherbits > otherbits))
+            break;
+        wherep = &q->child[tree_direction(q, prop->key, len)];
+    }
+    node->child[direction] = *wherep;
+    *wherep = (char *) node + 1;
+    return 0;
+}
+
+static void prop_tree_remove(Property *prop)
+{
+    size_t len = strlen(prop->key);
+    void **wherep = &prop_tree, **whereq = NULL;
+    PropTreeNode *q = NULL;
+    int direction = 0;
+
+    if (prop_tree == NULL)
+        return;
+    while (TREE_IS_NODE(*wherep)) {
+        whereq = wherep;
+        q = TREE_NODE(*wherep);
+        direction = tree_direction(q, prop->key, len);
+        wherep = &q->child[direction];
+    }
+    if (*wherep != prop)
+        return;
+
+    if (whereq == NULL) {
+        prop_tree = NULL;
+    } else {
+        *whereq = q->child[1 - direction];
+        free(q);
+    }
+}
+
+static int prop_tree_walk(void *p, int (*fn)(Property *prop, void *cookie),
+                          void *cookie)
+{
+    PropTreeNode *q;
+
+    if (!TREE_IS_NODE(p))
+        return fn(p, cookie);
+    q = TREE_NODE(p);
+    return prop_tree_walk(q->child[0], fn, cookie) ||
+           prop_tree_walk(q->child[1], fn, cookie);
+}
+
+/*
+ * Call fn, in key order, for every property whose key starts with prefix;
+ * stops early and returns nonzero if fn does.  fn must not add or remove
+ * properties.
+ */
+static int prop_tree_scan(const char *prefix,
+                          int (*fn)(Property *prop, void *cookie), void *cookie)
+{
+    size_t len = strlen(prefix);
+    PropTreeNode *q;
+    void *p, *top;
+
+    if (prop_tree == NULL)
+        return 0;
+
+    for (top = prop_tree; TREE_IS_NODE(top); top = q->child[tree_direction(q, prefix, len)]) {
+        q = TREE_NODE(top);
+        if (q->byte >= len)
+            break;
+    }
+
+    /* every key below top shares its first len bytes; check any one */
+    for (p = top; TREE_IS_NODE(p); p = TREE_NODE(p)->child[0])
+        ;
+    if (strncmp(((Property *) p)->key, prefix, len))
+        return 0;
+    return prop_tree_walk(top, fn, cookie);
+}
+
+/*
+ * Read-only properties.  Once the defaults are loaded, every ro.* property
+ * is frozen into an immutable table addressed by a minimal perfect hash
+ * (hash and displace): pa_hash picks a bucket, and the bucket's seed,
+ * chosen when the table is built, sends each of its keys to a distinct
+ * slot.  A lookup is two hashes and one key comparison, frozen records
+ * leave the mutable hash table, and sets of frozen keys are refused
+ * before the mutable store is touched.
+ */
+#define RO_BUCKET_LOAD      4       /* average keys per bucket */
+#define RO_SEED_TRIES       (1 << 20)
+
+static Property **ro_table;
+static uint32_t *ro_seeds;
+static unsigned ro_count;
+static unsigned ro_buckets;
+static int ro_sealed;               /* ro.* is write-once from now on */
+
+static int is_ro_key(const char *key)
+{
+    return key[0] == 'r' && key[1] == 'o' && key[2] == '.';
+}
+
+static uint32_t ro_hash(const char *key, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+
+    while (*key) {
+        h ^= (unsigned char) *key++;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+static Property *ro_find(const char *key, unsigned hash)
+{
+    Property *prop;
+
+    if (ro_count == 0)
+        return NULL;
+    prop = ro_table[ro_hash(key, ro_seeds[hash % ro_buckets]) % ro_count];
+    return strcmp(prop->key, key) == 0 ? prop : NULL;
+}
+
+struct ro_collect {
+    Property **props;
+    unsigned count;
+};
+
+static int ro_collect_one(Property *prop, void *cookie)
+{
+    struct ro_collect *rc = cookie;
+
+    if (rc->props != NULL)
+        rc->props[rc->count] = prop;
+    rc->count++;
+    return 0;
+}
+
+static Property **ro_sort_buckets;
+static unsigned *ro_bucket_start;
+
+static int ro_bucket_cmp(const void *a, const void *b)
+{
+    unsigned ba = *(const unsigned *) a, bb = *(const unsigned *) b;
+    unsigned sa = ro_bucket_start[ba + 1] - ro_bucket_start[ba];
+    unsigned sb = ro_bucket_start[bb + 1] - ro_bucket_start[bb];
+
+    return sa != sb ? (sa < sb ? 1 : -1) : (ba > bb) - (ba < bb);
+}
+
+/* returns 0, or -1 (leaving everything in the mutable store) on failure */
+static int freeze_ro_properties(void)
+{
+    struct ro_collect rc = { NULL, 0 };
+    Property **props = NULL, **table = NULL;
+    unsigned *start = NULL, *order = NULL, *fill = NULL;
+    uint32_t *seeds = NULL, seed;
+    unsigned n, nb, b, i, j, k, size, *slots = NULL;
+    unsigned char *used = NULL;
+    int result = -1;
+
+    ro_sealed = 1;
+    prop_tree_scan("ro.", ro_collect_one, &rc);
+    n = rc.count;
+    if (n == 0)
+        return 0;
+    nb = (n + RO_BUCKET_LOAD - 1) / RO_BUCKET_LOAD;
+
+    props = malloc(n * sizeof(*props));
+    table = malloc(n * sizeof(*table));
+    seeds = calloc(nb, sizeof(*seeds));
+    start = calloc(nb + 1, sizeof(*start));
+    fill = calloc(nb, sizeof(*fill));
+    order = malloc(nb * sizeof(*order));
+    slots = malloc(n * sizeof(*slots));
+    used = calloc(n, 1);
+    ro_sort_buckets = malloc(n * sizeof(*ro_sort_buckets));
+    if (!props || !table || !seeds || !start || !fill || !order || !slots ||
+            !used || !ro_sort_buckets)
+        goto fail;
+
+    rc.props = props;
+    rc.count = 0;
+    prop_tree_scan("ro.", ro_collect_one, &rc);
+
+    /* group the keys by bucket, then place the biggest buckets first */
+    for (i = 0; i < n; i++)
+        start[props[i]->hash % nb + 1]++;
+    for (b = 0; b < nb; b++)
+        start[b + 1] += start[b];
+    for (i = 0; i < n; i++) {
+        b = props[i]->hash % nb;
+        ro_sort_buckets[start[b] + fill[b]++] = props[i];
+    }
+    for (b = 0; b < nb; b++)
+        order[b] = b;
+    ro_bucket_start = start;
+    qsort(order, nb, sizeof(*order), ro_bucket_cmp);
+
+    for (k = 0; k < nb; k++) {
+        b = order[k];
+        size = start[b + 1] - start[b];
+        if (size == 0)
+            break;
+        for (seed = 1; seed < RO_SEED_TRIES; seed++) {
+            for (i = 0; i < size; i++) {
+                slots[i] = ro_hash(ro_sort_buckets[start[b] + i]->key, seed) % n;
+                if (used[slots[i]])
+                    break;
+                for (j = 0; j < i && slots[j] != slots[i]; j++)
+                    ;
+                if (j < i)
+                    break;
+            }
+            if (i == size)
+                break;
+        }
+        if (seed == RO_SEED_TRIES)
+            goto fail;
+        seeds[b] = seed;
+        for (i = 0; i < size; i++) {
+            used[slots[i]] = 1;
+            table[slots[i]] = ro_sort_buckets[start[b] + i];
+        }
+    }
+
+    /* the frozen records leave the mutable hash table */
+    for (i = 0; i < n; i++) {
+        k = prop_hash_find(props[i]->key, props[i]->hash);
+        prop_hash[k] = PROP_TOMBSTONE;
+        prop_count--;
+    }
+
+    ro_table = table;
+    ro_seeds = seeds;
+    ro_buckets = nb;
+    ro_count = n;
+    table = NULL;
+    seeds = NULL;
+    result = 0;
+    INFO("froze %u read-only properties\n", n);
+
+fail:
+    if (result < 0)
+        ERROR("could not freeze read-only properties\n");
+    free(ro_sort_buckets);
+    ro_sort_buckets = NULL;
+    ro_bucket_start = NULL;
+    free(props);
+    free(table);
+    free(seeds);
+    free(start);
+    free(fill);
+    free(order);
+    free(slots);
+    free(used);
+    return result;
+}
+
+static Property *prop_find(const char *key)
+{
+    unsigned hash = pa_hash(key);
+    Property *prop;
+    int i;
+
+    if (ro_count && is_ro_key(key) && (prop = ro_find(key, hash)) != NULL)
+        return prop;
+    i = prop_hash_find(key, hash);
+    return i < 0 ? NULL : prop_hash[i];
+}
+
+/*
+ * A connection to the property service.  Requests collect in `in` until a
+ * whole frame has arrived; replies and notifications wait in `out` until
+ * the socket takes them.  Clients belong to the service thread, except
+ * that whoever holds prop_lock may queue notifications to watchers.
+ */
+#define PROP_REQUEST_MAX        PROPERTY_COMMIT_MAX     /* any frame fits */
+#define PROP_CLIENT_OUT_HIGH    (64 * 1024)     /* stop taking requests past this */
+#define PROP_CLIENT_OUT_MAX     (4 << 20)       /* drop the client past this */
+#define PROP_CLIENT_TIMEOUT_MS  2000            /* for a frame or reply to move */
+
+typedef struct prop_client {
+    struct listnode clist;
+    int fd;                 /* -1 once closed */
+    pid_t pid;
+    unsigned events;        /* what epoll is watching for */
+    int stalled;            /* waiting for room in the event ring */
+    uint64_t deadline;      /* ms; 0 unless a frame or reply is pending */
+    unsigned char *out;
+    size_t out_off, out_len, out_cap;
+    int fds[2];             /* passed with the request, awaiting use */
+    int nfds;
+    prop_ring *ring;        /* handed over for property_publish */
+    int ring_kick;
+    uint32_t ring_head;     /* ours; the copy in the ring is for the client */
+    uint64_t ring_due;      /* ms; 0 unless a drain is scheduled */
+    size_t in_len;
+    unsigned char in[PROP_REQUEST_MAX];
+} PropClient;
+
+static pthread_mutex_t prop_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int client_reply(PropClient *c, const void *data, size_t len);
+static int client_flush(PropClient *c);
+static void client_arm(PropClient *c, int progressed);
+static unsigned char handle_ring(PropClient *c);
+
+/*
+ * Watches registered with kSystemPropertyWatch.  The connection that asked
+ * is sent a kSystemPropertyNotify frame whenever the key changes value.
+ */
+typedef struct prop_watch {
+    struct listnode wlist;
+    PropClient *client;
+    unsigned hash;
+    char key[PROPERTY_KEY_MAX];
+} PropWatch;
+
+static list_declare(watch_list);
+
+static unsigned char add_watch(PropClient *c, const char *key)
+{
+    PropWatch *w;
+
+    w = calloc(1, sizeof(*w));
+    if (w == NULL)
+        return (0);
+    w->client = c;
+    w->hash = pa_hash(key);
+    strlcpy(w->key, key, sizeof(w->key));
+    list_add_tail(&watch_list, &w->wlist);
+    return (1);
+}
+
+static void remove_watches(PropClient *c)
+{
+    struct listnode *node, *next;
+    PropWatch *w;
+
+    for (node = watch_list.next; node != &watch_list; node = next) {
+        next = node->next;
+        w = node_to_item(node, PropWatch, wlist);
+        if (w->client == c) {
+            list_remove(node);
+            free(w);
+        }
+    }
+}
+
+static void notify_watchers(const char *key, unsigned hash, const char *value)
+{
+    char frame[1 + PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX];
+    struct listnode *node;
+    PropWatch *w;
+
+    if (list_empty(&watch_list))
+        return;
+
+    memset(frame, 0, sizeof(frame));
+    frame[0] = kSystemPropertyNotify;
+    strlcpy(frame + 1, key, PROPERTY_KEY_MAX);
+    if (value != NULL)
+        strlcpy(frame + 1 + PROPERTY_KEY_MAX, value, PROPERTY_VALUE_MAX);
+
+    list_for_each(node, &watch_list) {
+        w = node_to_item(node, PropWatch, wlist);
+        if (w->hash != hash || strcmp(w->key, key))
+            continue;
+        /*
+         * A watcher that stopped reading is cut off once its backlog is
+         * full, so it sees EOF rather than a silently missed change.  The
+         * service thread notices the hangup and closes it.
+         */
+        if (client_reply(w->client, frame, sizeof(frame)) < 0 ||
+                client_flush(w->client) < 0) {
+            ERROR("property watcher pid %d not keeping up, dropping it\n",
+                  w->client->pid);
+            shutdown(w->client->fd, SHUT_RDWR);
+            continue;
+        }
+        client_arm(w->client, 0);
+    }
+}
+
+/*
+ * Recent changes, for working out after the fact who set what and when.
+ * The ring is static and entries are filled in place, so recording costs
+ * a clock read and a few short copies on the set path.  Values are kept
+ * truncated to PROPERTY_VALUE_MAX - 1 bytes, as in listings.
+ */
+#define PROP_HISTORY_SIZE   256     /* power of two */
+
+#define HISTORY_CREATED     0x01    /* there was no old value */
+#define HISTORY_REMOVED     0x02    /* there is no new value */
+
+typedef struct prop_change {
+    uint64_t time_ns;       /* CLOCK_MONOTONIC */
+    pid_t pid;
+    unsigned char flags;
+    char key[PROPERTY_KEY_MAX];
+    char old_value[PROPERTY_VALUE_MAX];
+    char new_value[PROPERTY_VALUE_MAX];
+} PropChange;
+
+static PropChange history[PROP_HISTORY_SIZE];
+static unsigned history_next;       /* total recorded; wraps harmlessly */
+static pid_t history_self;
+static pid_t history_pid;           /* whoever the current request is from */
+
+/*
+ * Start an entry in the next slot.  It only becomes part of the history
+ * once history_commit is called, so a set that fails part way leaves
+ * nothing behind.
+ */
+static PropChange *history_begin(const char *key, const char *old_value)
+{
+    PropChange *h = &history[history_next & (PROP_HISTORY_SIZE - 1)];
+
+    strlcpy(h->key, key, sizeof(h->key));
+    if (old_value != NULL) {
+        strlcpy(h->old_value, old_value, sizeof(h->old_value));
+        h->flags = 0;
+    } else {
+        h->old_value[0] = 0;
+        h->flags = HISTORY_CREATED;
+    }
+    return h;
+}
+
+static void history_commit(PropChange *h, const char *new_value)
+{
+    struct timespec ts;
+
+    if (new_value != NULL)
+        strlcpy(h->new_value, new_value, sizeof(h->new_value));
+    else {
+        h->new_value[0] = 0;
+        h->flags |= HISTORY_REMOVED;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    h->time_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    h->pid = history_pid ? history_pid : history_self;
+    history_next++;
+}
+
+/*
+ * Once the service is up an ro.* property is write-once: the frozen ones
+ * can't change, and one first set later can't change after that either.
+ */
+static int prop_frozen(const char *key, unsigned hash)
+{
+    if (!ro_sealed || !is_ro_key(key))
+        return 0;
+    return ro_find(key, hash) != NULL || prop_hash_find(key, hash) >= 0;
+}
+
+static unsigned char get_property(const char* key, char* valueBuf)
+{
+    Property *prop;
+
+    assert(key != NULL);
+    assert(valueBuf != NULL);
+
+    prop = prop_find(key);
+    if (prop == NULL) {
+        //printf("Prop: get [%s] not found\n", key);
+        return (0);
+    }
+
+    strcpy(valueBuf, prop->value);
+    return (1);
+}
+
+/*
+ * A set split in two, so that a batch of them can be applied as one
+ * change: prop_stage makes every allocation the set needs, and can fail;
+ * prop_apply then only moves things into place, and can't.  A new record
+ * is put in the ordered index when staged (prop_unstage takes it out
+ * again) and in the hash table when applied, for which the caller must
+ * have reserved room.
+ */
+typedef struct prop_staged {
+    const char *key;
+    const char *value;
+    unsigned hash;
+    Property *prop;             /* the record to update, or the new one */
+    char *long_value;           /* copy of a long value, made in advance */
+    unsigned char created;      /* prop is a new record */
+    unsigned char changed;      /* set by prop_apply */
+} PropStaged;
+
+static int prop_stage(PropStaged *s)
+{
+    int i = prop_hash_find(s->key, s->hash);
+
+    s->created = s->changed = 0;
+    s->long_value = NULL;
+    if (strlen(s->value) >= PROPERTY_VALUE_MAX) {
+        s->long_value = strdup(s->value);
+        if (s->long_value == NULL)
+            return -1;
+    }
+    if (i >= 0) {
+        s->prop = prop_hash[i];
+        return 0;
+    }
+
+    s->prop = prop_alloc();
+    if (s->prop == NULL)
+        goto fail;
+    strcpy(s->prop->key, s->key);
+    s->prop->hash = s->hash;
+    s->prop->long_value = NULL;
+    s->prop->pi = NULL;
+    if (prop_tree_insert(s->prop) < 0) {
+        prop_release(s->prop);
+        goto fail;
+    }
+    s->created = 1;
+    return 0;
+
+fail:
+    free(s->long_value);
+    s->long_value = NULL;
+    return -1;
+}
+
+static void prop_unstage(PropStaged *s)
+{
+    if (s->created) {
+        prop_tree_remove(s->prop);
+        prop_release(s->prop);
+    }
+    free(s->long_value);
+    s->long_value = NULL;
+}
+
+static void prop_apply(PropStaged *s)
+{
+    Property *prop = s->prop;
+    PropChange *change;
+
+    if (!s->created && strcmp(prop_value(prop), s->value) == 0) {
+        free(s->long_value);
+        s->long_value = NULL;
+        return;
+    }
+
+    change = history_begin(s->key, s->created ? NULL : prop->value);
+    free(prop->long_value);
+    prop->long_value = s->long_value;
+    s->long_value = NULL;
+    strlcpy(prop->value, s->value, sizeof(prop->value));
+    if (s->created) {
+        prop_hash_insert(prop);
+        prop->pi = area_find_or_alloc(prop->key);
+    }
+    history_commit(change, prop->value);
+    area_write(prop->pi, s->value);
+    s->changed = 1;
+}
+
+static unsigned char set_property(const char* key, const char* value)
+{
+    PropStaged staged;
+    unsigned hash;
+    Property *prop;
+    int i;
+
+    assert(key != NULL);
+    //assert(value != NULL);
+
+    if (strlen(key) >= PROPERTY_KEY_MAX)
+        return (0);
+    if (value != NULL && strlen(value) >= PROPERTY_LONG_VALUE_MAX)
+        return (0);
+
+    hash = pa_hash(key);
+    if (prop_frozen(key, hash))
+        return (0);
+
+    if (value == NULL) {
+        i = prop_hash_find(key, hash);
+        if (i < 0)
+            return (1);
+        //printf("Prop: removing [%s]\n", prop->key);
+        prop = prop_hash[i];
+        history_commit(history_begin(key, prop->value), NULL);
+        area_write(prop->pi, NULL);
+        notify_watchers(key, hash, NULL);
+        prop_hash[i] = PROP_TOMBSTONE;
+        prop_count--;
+        prop_tree_remove(prop);
+        prop_release(prop);
+        return (1);
+    }
+
+    staged.key = key;
+    staged.value = value;
+    staged.hash = hash;
+    if (prop_hash_reserve(1) < 0 || prop_stage(&staged) < 0)
+        return (0);
+    prop_apply(&staged);
+    if (staged.changed)
+        notify_watchers(key, hash, staged.prop->value);
+
+    return (1);
+}
+
+struct foreach_args {
+    void (*fn)(const char *key, const char *value, void *cookie);
+    void *cookie;
+};
+
+static int foreach_one(Property *prop, void *cookie)
+{
+    struct foreach_args *args = cookie;
+
+    args->fn(prop->key, prop_value(prop), args->cookie);
+    return 0;
+}
+
+void property_foreach(const char *prefix,
+                      void (*fn)(const char *key, const char *value, void *cookie),
+                      void *cookie)
+{
+    struct foreach_args args = { fn, cookie };
+
+    prop_tree_scan(prefix, foreach_one, &args);
+}
+
+/*
+ * Store a value, journalling it first if it is persistent.  Called with
+ * prop_lock held.
+ */
+static unsigned char store_set(const char *key, const char *value)
+{
+    if (persistent_properties_loaded &&
+            strncmp("persist.", key, strlen("persist.")) == 0) {
+        /* 
+         * Don't write properties to disk until after we have read all default properties
+         * to prevent them from being overwritten by default values.
+         */
+        persist_write(key, value);
+    }
+    return set_property(key, value);
+}
+
+/*
+ * Set count properties, with distinct keys, as one change.  Every entry
+ * is staged before any is applied, so that either all of them land or,
+ * if an allocation fails, none does; they are then applied with readers
+ * of the shared area held off.  Persistent ones are journalled and
+ * watchers told only after that, once readers can go on.  Called with
+ * prop_lock held; the caller has already refused frozen and ctl.* keys.
+ * Returns 0 or -1.
+ */
+static int store_set_batch(PropStaged *staged, int count)
+{
+    int i, created = 0;
+
+    for (i = 0; i < count; i++) {
+        staged[i].hash = pa_hash(staged[i].key);
+        if (prop_stage(&staged[i]) < 0)
+            goto fail;
+        created += staged[i].created;
+    }
+    if (prop_hash_reserve(created) < 0)
+        goto fail;
+
+    area_commit_begin();
+    for (i = 0; i < count; i++)
+        prop_apply(&staged[i]);
+    area_commit_end();
+
+    for (i = 0; i < count; i++) {
+        if (persistent_properties_loaded &&
+                strncmp("persist.", staged[i].key, strlen("persist.")) == 0)
+            persist_write(staged[i].key, staged[i].value);
+        if (staged[i].changed)
+            notify_watchers(staged[i].key, staged[i].hash, staged[i].prop->value);
+    }
+    return 0;
+
+fail:
+    while (i-- > 0)
+        prop_unstage(&staged[i]);
+    return -1;
+}
+
+unsigned char property_set(const char *key, const char *value)
+{
+    unsigned char result;
+
+    if(memcmp(key,"ctl.",4) == 0) {
+        handle_control_message(key+4, value);
+		return (1);
+	} 
+
+    pthread_mutex_lock(&prop_lock);
+    result = store_set(key, value);
+    pthread_mutex_unlock(&prop_lock);
+    if (!result)
+        return (0);
+
+    queue_property_triggers(key, value);
+    return (1);
+}
+
+int property_get(const char *name, char *value, size_t size)
+{
+    Property *prop;
+    int len = -1;
+
+    pthread_mutex_lock(&prop_lock);
+    prop = prop_find(name);
+    if (prop != NULL)
+        len = strlcpy(value, prop_value(prop), size);
+    pthread_mutex_unlock(&prop_lock);
+    return len;
+}
+
+static int create_property_socket(const char* fileName)
+{
+    struct stat sb;
+    int result = -1;
+    int sock = -1;
+    int cc;
+
+    cc = stat(fileName, &sb);
+    if (cc < 0) {
+        if (errno != ENOENT) {
+            printf(
+                "Unable to stat '%s' (errno=%d)\n", fileName, errno);
+            goto bail;
+        }
+    } else {
+        /* don't touch it if it's not a socket */
+        if (!(S_ISSOCK(sb.st_mode))) {
+            printf(
+                "File '%s' exists and is not a socket\n", fileName);
+            goto bail;
+        }
+
+        /* remove the cruft */
+        if (unlink(fileName) < 0) {
+            printf(
+                "Unable to remove '%s' (errno=%d)\n", fileName, errno);
+            goto bail;
+        }
+    }
+
+    struct sockaddr_un addr;
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        printf(
+            "UNIX domain socket create failed (errno=%d)\n", errno);
+        goto bail;
+    }
+
+    /* bind the socket; this creates the file on disk */
+    strcpy(addr.sun_path, fileName);    // max 108 bytes
+    addr.sun_family = AF_UNIX;
+    cc = bind(sock, (struct sockaddr*) &addr, SUN_LEN(&addr));
+    if (cc < 0) {
+        printf("AF_UNIX bind failed for '%s' (errno=%d)\n", fileName, errno);
+        goto bail;
+    }
+
+    cc = listen(sock, 5);
+    if (cc < 0) {
+        printf("AF_UNIX listen failed (errno=%d)\n", errno);
+        goto bail;
+    }
+
+    result = sock;
+    sock = -1;
+    return result;
+
+bail:
+    if (sock >= 0)
+        close(sock);
+    return result;
+}
+
+
+/*
+ * Length of the request frame at req, of which len bytes have arrived:
+ * 0 if that isn't known yet, -1 if the frame is malformed.
+ */
+static ssize_t request_length(const unsigned char *req, size_t len)
+{
+    size_t klen, vlen, off;
+    int i;
+
+    switch (req[0]) {
+    case kSystemPropertyGet:
+    case kSystemPropertyWatch:
+    case kSystemPropertyList:
+        return 1 + PROPERTY_KEY_MAX;
+    case kSystemPropertySet:
+        return 1 + PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX;
+    case kSystemPropertyGetMany:
+    case kSystemPropertySetMany:
+        if (len < 2)
+            return 0;
+        if (req[1] == 0 || req[1] > PROPERTY_BATCH_MAX)
+            break;
+        if (req[0] == kSystemPropertyGetMany)
+            return 2 + req[1] * PROPERTY_KEY_MAX;
+        return 2 + req[1] * (PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX);
+    case kSystemPropertyHello:
+        return 2;
+    case kSystemPropertyGetV2:
+        if (len < 2)
+            return 0;
+        if (req[1] == 0 || req[1] >= PROPERTY_KEY_MAX)
+            break;
+        return 2 + req[1];
+    case kSystemPropertySetV2:
+        if (len < 4)
+            return 0;
+        klen = req[1];
+        vlen = req[2] | (req[3] << 8);
+        if (klen == 0 || klen >= PROPERTY_KEY_MAX || vlen >= PROPERTY_LONG_VALUE_MAX)
+            break;
+        return 4 + klen + vlen;
+    case kSystemPropertyHistory:
+    case kSystemPropertyRing:
+        return 1;
+    case kSystemPropertyCommit:
+        if (len < 2)
+            return 0;
+        if (req[1] == 0 || req[1] > PROPERTY_BATCH_MAX)
+            break;
+        for (off = 2, i = 0; i < req[1]; i++) {
+            if (off + 3 > PROPERTY_COMMIT_MAX)
+                goto bad;
+            if (off + 3 > len)
+                return 0;
+            klen = req[off];
+            vlen = req[off + 1] | (req[off + 2] << 8);
+            if (klen == 0 || klen >= PROPERTY_KEY_MAX || vlen >= PROPERTY_LONG_VALUE_MAX)
+                goto bad;
+            off += 3 + klen + vlen;
+        }
+        if (off > PROPERTY_COMMIT_MAX)
+            break;
+        return off;
+    default:
+        fprintf(stderr, "Unexpected request %d from prop client\n", req[0]);
+        return -1;
+    }
+
+bad:
+    fprintf(stderr, "Bad request %d from prop client\n", req[0]);
+    return -1;
+}
+
+/* requests that may post events to the main loop */
+static int request_sets(const unsigned char *req)
+{
+    return req[0] == kSystemPropertySet || req[0] == kSystemPropertySetMany ||
+           req[0] == kSystemPropertySetV2 || req[0] == kSystemPropertyCommit;
+}
+
+/*
+ * Events for init's main loop.  The service thread is the only producer
+ * and the main loop the only consumer, so the ring needs no lock: each
+ * side owns its index and publishes it with release ordering.  An eventfd
+ * tells the main loop there is something to do.  A request that sets
+ * properties is only taken on while there is room for a full batch of
+ * events; otherwise its client waits until the main loop catches up and
+ * wakes the service thread.
+ */
+#define PROP_EVENT_RING     1024    /* power of two */
+
+enum {
+    PROP_EVENT_CONTROL,     /* ctl.* message */
+    PROP_EVENT_TRIGGER,     /* property changed; queue its triggers */
+};
+
+typedef struct prop_event {
+    int type;
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    char *long_value;       /* the full value, when it doesn't fit */
+} PropEvent;
+
+static PropEvent event_ring[PROP_EVENT_RING];
+static unsigned event_head;     /* next to consume; main loop */
+static unsigned event_tail;     /* next to fill; service thread */
+static int event_fd = -1;       /* the main loop polls this */
+static int events_posted;       /* service thread: ring written, not yet signalled */
+static int event_stalled;       /* a client is waiting for room */
+static int prop_wake_fd = -1;   /* wakes the service thread */
+static pthread_t prop_thread;
+
+static unsigned event_room(void)
+{
+    return PROP_EVENT_RING - (event_tail - __atomic_load_n(&event_head, __ATOMIC_SEQ_CST));
+}
+
+/*
+ * Is there room for a request's worth of events?  If not, ask the main
+ * loop for a wakeup, checking again afterwards in case it drained the
+ * ring in between.
+ */
+static int event_reserve(void)
+{
+    if (event_room() >= PROPERTY_BATCH_MAX)
+        return 1;
+    __atomic_store_n(&event_stalled, 1, __ATOMIC_SEQ_CST);
+    return event_room() >= PROPERTY_BATCH_MAX;
+}
+
+static void post_event(int type, const char *key, const char *value)
+{
+    PropEvent *e = &event_ring[event_tail & (PROP_EVENT_RING - 1)];
+
+    e->type = type;
+    strlcpy(e->key, key, sizeof(e->key));
+    strlcpy(e->value, value, sizeof(e->value));
+    e->long_value = strlen(value) >= sizeof(e->value) ? strdup(value) : NULL;
+    __atomic_store_n(&event_tail, event_tail + 1, __ATOMIC_RELEASE);
+    events_posted = 1;
+}
+
+static void wake_service(void)
+{
+    uint64_t one = 1;
+
+    write(prop_wake_fd, &one, sizeof(one));
+}
+
+/*
+ * A set from a client.  What init itself has to act on, control messages
+ * and property triggers, is handed to the main loop.  Called with
+ * prop_lock held.
+ */
+static unsigned char client_set(const char *key, const char *value)
+{
+    if (memcmp(key, "ctl.", 4) == 0) {
+        post_event(PROP_EVENT_CONTROL, key, value);
+        return (1);
+    }
+    if (!store_set(key, value))
+        return (0);
+    post_event(PROP_EVENT_TRIGGER, key, value);
+    return (1);
+}
+
+/*
+ * kSystemPropertyGetMany: a count byte followed by that many keys; the
+ * reply is, per key, a found byte and a value.
+ */
+static unsigned char handle_get_many(PropClient *c, unsigned char *req)
+{
+    char replyBuf[PROPERTY_BATCH_MAX * (1 + PROPERTY_VALUE_MAX)];
+    unsigned char count = req[1];
+    char *key, *reply;
+    int i;
+
+    memset(replyBuf, 0, count * (1 + PROPERTY_VALUE_MAX));
+    for (i = 0; i < count; i++) {
+        key = (char *) req + 2 + i * PROPERTY_KEY_MAX;
+        reply = replyBuf + i * (1 + PROPERTY_VALUE_MAX);
+        key[PROPERTY_KEY_MAX - 1] = 0;
+        reply[0] = get_property(key, reply + 1);
+    }
+
+    return client_reply(c, replyBuf, count * (1 + PROPERTY_VALUE_MAX)) == 0;
+}
+
+/*
+ * kSystemPropertySetMany: a count byte followed by that many key/value
+ * pairs; the reply is one result byte per pair.
+ */
+static unsigned char handle_set_many(PropClient *c, unsigned char *req)
+{
+    unsigned char replyBuf[PROPERTY_BATCH_MAX];
+    unsigned char count = req[1];
+    char *key;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        key = (char *) req + 2 + i * (PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX);
+        key[PROPERTY_KEY_MAX - 1] = 0;
+        key[PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX - 1] = 0;
+        replyBuf[i] = client_set(key, key + PROPERTY_KEY_MAX);
+    }
+
+    return client_reply(c, replyBuf, count) == 0;
+}
+
+/*
+ * kSystemPropertyCommit: a count byte, then that many entries of key
+ * length, 16-bit little-endian value length, key and value; the reply is
+ * one result byte.  Where a key appears more than once its last value is
+ * the one set.  If any entry would be rejected (a frozen or ctl.* key, or
+ * a second write to an ro.* key) nothing is set; otherwise the entries go
+ * through store_set_batch, and triggers then run once per key.
+ */
+static unsigned char handle_commit(PropClient *c, unsigned char *req)
+{
+    char buf[PROPERTY_COMMIT_MAX];
+    char *keys[PROPERTY_BATCH_MAX], *values[PROPERTY_BATCH_MAX];
+    PropStaged staged[PROPERTY_BATCH_MAX];
+    unsigned char count = req[1], result = 1;
+    size_t off = 2, used = 0, klen, vlen;
+    int i, j, n = 0;
+
+    /* the 3-byte entry headers make room for the terminators */
+    for (i = 0; i < count; i++) {
+        klen = req[off];
+        vlen = req[off + 1] | (req[off + 2] << 8);
+        keys[i] = buf + used;
+        memcpy(keys[i], req + off + 3, klen);
+        keys[i][klen] = 0;
+        values[i] = keys[i] + klen + 1;
+        memcpy(values[i], req + off + 3 + klen, vlen);
+        values[i][vlen] = 0;
+        used += klen + vlen + 2;
+        off += 3 + klen + vlen;
+
+        if (memcmp(keys[i], "ctl.", 4) == 0 || prop_frozen(keys[i], pa_hash(keys[i])))
+            result = 0;
+    }
+
+    for (i = 0; result && i < count; i++) {
+        for (j = i + 1; j < count && strcmp(keys[i], keys[j]); j++)
+            ;
+        if (j < count) {            /* a later entry overrides this one */
+            if (is_ro_key(keys[i]))
+                result = 0;
+            continue;
+        }
+        staged[n].key = keys[i];
+        staged[n].value = values[i];
+        n++;
+    }
+
+    if (result && store_set_batch(staged, n) < 0)
+        result = 0;
+    if (result) {
+        for (i = 0; i < n; i++)
+            post_event(PROP_EVENT_TRIGGER, staged[i].key, staged[i].value);
+    }
+
+    return client_reply(c, &result, 1) == 0;
+}
+
+/*
+ * kSystemPropertyList: the request carries a key prefix ("" for all).
+ * Matching properties are streamed back in key order as records of key
+ * length, value length, key and value (no terminators), closed by an
+ * empty record.  Only the matching subtree of the index is visited.
+ */
+static int list_one(Property *prop, void *cookie)
+{
+    PropClient *c = cookie;
+    unsigned char hdr[2];
+
+    hdr[0] = strlen(prop->key);
+    hdr[1] = strlen(prop->value);
+    if (client_reply(c, hdr, 2) < 0 ||
+            client_reply(c, prop->key, hdr[0]) < 0 ||
+            client_reply(c, prop->value, hdr[1]) < 0)
+        return -1;
+    return 0;
+}
+
+static unsigned char handle_list(PropClient *c, unsigned char *req)
+{
+    char *prefix = (char *) req + 1;
+    static const unsigned char end[2];
+
+    prefix[PROPERTY_KEY_MAX - 1] = 0;
+    return prop_tree_scan(prefix, list_one, c) == 0 &&
+           client_reply(c, end, sizeof(end)) == 0;
+}
+
+/*
+ * kSystemPropertyHistory: no arguments.  The recorded changes come back
+ * oldest first, each as a 16-byte header followed by key, old value and
+ * new value (no terminators), closed by a record with an empty key:
+ *
+ *   [time_ns:8][pid:4][flags][klen][olen][nlen]
+ *
+ * Integers are little-endian; flags are HISTORY_CREATED/HISTORY_REMOVED.
+ */
+static void put_le(unsigned char *p, uint64_t v, int len)
+{
+    while (len-- > 0) {
+        *p++ = v & 0xff;
+        v >>= 8;
+    }
+}
+
+static unsigned char handle_history(PropClient *c)
+{
+    unsigned char hdr[16];
+    const PropChange *h;
+    unsigned i, first;
+
+    first = history_next > PROP_HISTORY_SIZE ? history_next - PROP_HISTORY_SIZE : 0;
+
+    for (i = first; i != history_next; i++) {
+        h = &history[i & (PROP_HISTORY_SIZE - 1)];
+        put_le(hdr, h->time_ns, 8);
+        put_le(hdr + 8, h->pid, 4);
+        hdr[12] = h->flags;
+        hdr[13] = strlen(h->key);
+        hdr[14] = strlen(h->old_value);
+        hdr[15] = strlen(h->new_value);
+        if (client_reply(c, hdr, sizeof(hdr)) < 0 ||
+                client_reply(c, h->key, hdr[13]) < 0 ||
+                client_reply(c, h->old_value, hdr[14]) < 0 ||
+                client_reply(c, h->new_value, hdr[15]) < 0)
+            return (0);
+    }
+
+    memset(hdr, 0, sizeof(hdr));
+    return client_reply(c, hdr, sizeof(hdr)) == 0;
+}
+
+/*
+ * Protocol version 2.  A client that sends kSystemPropertyHello with the
+ * highest version it speaks gets back the version both sides will use;
+ * v1 clients never send it and keep using the fixed-size frames above.
+ * v2 frames carry only the bytes in use, with 16-bit little-endian value
+ * lengths, and values up to PROPERTY_LONG_VALUE_MAX - 1 bytes:
+ *
+ *   GetV2:  [op][klen][key]              ->  [found][vlen:2][value]
+ *   SetV2:  [op][klen][vlen:2][key][value]  ->  [result]
+ */
+static unsigned char handle_hello(PropClient *c, unsigned char *req)
+{
+    unsigned char reply[2];
 
-static unsigned char get_property(const char* key, char* valueBuf)
+    reply[0] = kSystemPropertyHello;
+    reply[1] = req[1] < PROPERTY_PROTOCOL_VERSION ? req[1] : PROPERTY_PROTOCOL_VERSION;
+    return client_reply(c, reply, 2) == 0;
+}
+
+static unsigned char handle_get_v2(PropClient *c, unsigned char *req)
 {
-    assert(key != NULL);
-    assert(valueBuf != NULL);
+    char key[PROPERTY_KEY_MAX];
+    unsigned char reply[3 + PROPERTY_LONG_VALUE_MAX];
+    Property *prop;
+    size_t vlen = 0;
+
+    memcpy(key, req + 2, req[1]);
+    key[req[1]] = 0;
+
+    prop = prop_find(key);
+    reply[0] = prop != NULL;
+    if (prop != NULL) {
+        vlen = strlen(prop_value(prop));
+        memcpy(reply + 3, prop_value(prop), vlen);
+    }
+    reply[1] = vlen & 0xff;
+    reply[2] = vlen >> 8;
+    return client_reply(c, reply, 3 + vlen) == 0;
+}
 
-	struct listnode *node;
-	Property *prop;
+static unsigned char handle_set_v2(PropClient *c, unsigned char *req)
+{
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_LONG_VALUE_MAX];
+    size_t klen = req[1], vlen = req[2] | (req[3] << 8);
+    unsigned char result;
+
+    memcpy(key, req + 4, klen);
+    key[klen] = 0;
+    memcpy(value, req + 4 + klen, vlen);
+    value[vlen] = 0;
+
+    result = client_set(key, value);
+    return client_reply(c, &result, 1) == 0;
+}
 
+/*
+ * Carry out one complete request frame.  Called with prop_lock held.
+ * Returns 0 if the client should be dropped.
+ */
+static unsigned char handle_request(PropClient *c, unsigned char *req)
+{
+    char valueBuf[1 + PROPERTY_VALUE_MAX];
+    char *key = (char *) req + 1;
 
-    list_for_each(node, &prop_list) {
-        prop = node_to_item(node, Property, plist);
-        if (strcmp(prop->key, key) == 0) {
-            if (strlen(prop->value) >= PROPERTY_VALUE_MAX) {
-                fprintf(stderr,
-                    "GLITCH: properties table holds '%s' '%s' (len=%d)\n",
-                    prop->key, prop->value, (int) strlen(prop->value));
-                abort();
-            }
-            assert(strlen(prop->value) < PROPERTY_VALUE_MAX);
-            strcpy(valueBuf, prop->value);
-            return (1);
-        }
+    memset(valueBuf, 'x', sizeof(valueBuf));        // placate valgrind
+
+    if (req[0] == kSystemPropertyGet) {
+        key[PROPERTY_KEY_MAX - 1] = 0;
+        if (get_property(key, valueBuf+1))
+            valueBuf[0] = 1;
+        else
+            valueBuf[0] = 0;
+        //printf("GET property [%s]: (found=%d) [%s]\n",
+        //    key, valueBuf[0], valueBuf+1);
+        return client_reply(c, valueBuf, sizeof(valueBuf)) == 0;
+    } else if (req[0] == kSystemPropertySet) {
+        key[PROPERTY_KEY_MAX - 1] = 0;
+        key[PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX - 1] = 0;
+        //printf("SET property '%s'\n", key);
+        valueBuf[0] = client_set(key, key + PROPERTY_KEY_MAX);
+        return client_reply(c, valueBuf, 1) == 0;
+    } else if (req[0] == kSystemPropertyGetMany) {
+        return handle_get_many(c, req);
+    } else if (req[0] == kSystemPropertySetMany) {
+        return handle_set_many(c, req);
+    } else if (req[0] == kSystemPropertyWatch) {
+        /*
+         * From here on this connection also carries notifications, so the
+         * reply is framed the same way: opcode byte, then the result.
+         */
+        key[PROPERTY_KEY_MAX - 1] = 0;
+        valueBuf[0] = kSystemPropertyWatch;
+        valueBuf[1] = add_watch(c, key);
+        return client_reply(c, valueBuf, 2) == 0;
+    } else if (req[0] == kSystemPropertyList) {
+        return handle_list(c, req);
+    } else if (req[0] == kSystemPropertyHello) {
+        return handle_hello(c, req);
+    } else if (req[0] == kSystemPropertyGetV2) {
+        return handle_get_v2(c, req);
+    } else if (req[0] == kSystemPropertySetV2) {
+        return handle_set_v2(c, req);
+    } else if (req[0] == kSystemPropertyHistory) {
+        return handle_history(c);
+    } else if (req[0] == kSystemPropertyCommit) {
+        return handle_commit(c, req);
+    } else if (req[0] == kSystemPropertyRing) {
+        return handle_ring(c);
     }
 
-    //printf("Prop: get [%s] not found\n", key);
     return (0);
 }
 
-static unsigned char set_property(const char* key, const char* value)
+/*
+ * The property service runs on a thread of its own, so a client that
+ * stalls half way through a frame, or stops reading its replies, holds
+ * up nobody but itself.  Every socket is non-blocking and watched through
+ * one epoll set; a client whose partial frame or unsent reply has not
+ * moved for PROP_CLIENT_TIMEOUT_MS is dropped.  The store is shared with
+ * init's main thread under prop_lock.
+ */
+#define PROP_MAX_EVENTS     16
+#define PROP_SWEEP_MS       250     /* how often deadlines are checked */
+#define PROP_RING_DELAY_MS  20      /* lets ring updates gather */
+#define RING_TAG            1       /* marks a ring's eventfd in epoll data */
+
+static int prop_listen_fd = -1;
+static int prop_epoll_fd = -1;
+static list_declare(client_list);
+static list_declare(closed_list);   /* freed once the current events are done */
+static unsigned prop_timed_clients; /* clients with a deadline */
+static unsigned prop_rings_due;     /* rings with a drain scheduled */
+
+static uint64_t now_ms(void)
 {
-	struct listnode *node;
-	Property *prop;
-    assert(key != NULL);
-    //assert(value != NULL);
+    struct timespec ts;
 
-    list_for_each(node, &prop_list) {
-        prop = node_to_item(node, Property, plist);
-        if (strcmp(prop->key, key) == 0) {
-            if (value != NULL) {
-                //printf("Prop: replacing [%s]: [%s] with [%s]\n",
-                 //   prop->key, prop->value, value);
-                strcpy(prop->value, value);
-            } else {
-                //printf("Prop: removing [%s]\n", prop->key);
-                list_remove(node);
-				free(prop);
-            }
-            return (1);
-        }
-    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    //printf("Prop: adding [%s]: [%s]\n", key, value);
-    Property *new = malloc(sizeof(Property));
-    strcpy(new->key, key);
-    strcpy(new->value, value);
-	list_add_tail(&prop_list, &(new->plist));
+/* queue len bytes of reply; -1 if the client has too much unsent already */
+static int client_reply(PropClient *c, const void *data, size_t len)
+{
+    unsigned char *tmp;
+    size_t cap;
 
-    return (1);
+    if (c->out_len + len > c->out_cap && c->out_off > 0) {
+        memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+        c->out_len -= c->out_off;
+        c->out_off = 0;
+    }
+    if (c->out_len + len > c->out_cap) {
+        if (c->out_len + len > PROP_CLIENT_OUT_MAX)
+            return -1;
+        cap = c->out_cap ? c->out_cap : 1024;
+        while (cap < c->out_len + len)
+            cap *= 2;
+        tmp = realloc(c->out, cap);
+        if (tmp == NULL)
+            return -1;
+        c->out = tmp;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    return 0;
 }
 
-static void write_peristent_property(const char *name, const char *value)
+/* send what the socket will take; returns 1 if anything went, -1 on error */
+static int client_flush(PropClient *c)
 {
-    const char *tempPath = PERSISTENT_PROPERTY_DIR "/.temp";
-    char path[PATH_MAX];
-    int fd, length;
+    ssize_t n;
+    int sent = 0;
+
+    while (c->out_off < c->out_len) {
+        n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+                 MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+            return -1;
+        c->out_off += n;
+        sent = 1;
+    }
+    if (c->out_off == c->out_len)
+        c->out_off = c->out_len = 0;
+    return sent;
+}
 
-    snprintf(path, sizeof(path), "%s/%s", PERSISTENT_PROPERTY_DIR, name);
+/*
+ * Bring the client's epoll events and deadline up to date.  Requests are
+ * only read while the client keeps up with its replies and isn't waiting
+ * for room in the event ring.
+ */
+static void client_arm(PropClient *c, int progressed)
+{
+    struct epoll_event ev;
+    unsigned events = 0;
+    int pending;
+
+    if (!c->stalled && c->out_len - c->out_off < PROP_CLIENT_OUT_HIGH)
+        events |= EPOLLIN;
+    if (c->out_len > c->out_off)
+        events |= EPOLLOUT;
+    if (events != c->events) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.ptr = c;
+        epoll_ctl(prop_epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = events;
+    }
 
-    fd = open(tempPath, O_WRONLY|O_CREAT|O_TRUNC, 0600);
-    if (fd < 0) {
-        ERROR("Unable to write persistent property to temp file %s errno: %d\n", tempPath, errno);
-        return;   
+    pending = (c->in_len > 0 && !c->stalled) || c->out_len > c->out_off;
+    if (pending && (c->deadline == 0 || progressed)) {
+        if (c->deadline == 0 && prop_timed_clients++ == 0 &&
+                !pthread_equal(pthread_self(), prop_thread))
+            wake_service();     /* it may be sleeping without a timeout */
+        c->deadline = now_ms() + PROP_CLIENT_TIMEOUT_MS;
+    } else if (!pending && c->deadline != 0) {
+        c->deadline = 0;
+        prop_timed_clients--;
     }
-    write(fd, value, strlen(value));
-    close(fd);
+}
 
-    if (rename(tempPath, path)) {
-        unlink(tempPath);
-        ERROR("Unable to rename persistent property file %s to %s\n", tempPath, path);
+static void client_close(PropClient *c)
+{
+    remove_watches(c);
+    epoll_ctl(prop_epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    if (c->deadline != 0)
+        prop_timed_clients--;
+    while (c->nfds > 0)
+        close(c->fds[--c->nfds]);
+    if (c->ring != NULL) {
+        epoll_ctl(prop_epoll_fd, EPOLL_CTL_DEL, c->ring_kick, NULL);
+        close(c->ring_kick);
+        munmap(c->ring, sizeof(prop_ring));
+        c->ring = NULL;
+        if (c->ring_due != 0)
+            prop_rings_due--;
     }
+    list_remove(&c->clist);
+    list_add_tail(&closed_list, &c->clist);
 }
 
-unsigned char property_set(const char *key, const char *value)
+/*
+ * kSystemPropertyRing: no arguments, but the memfd holding a prop_ring and
+ * an eventfd come along with it.  From then on propd drains the ring on
+ * the client's behalf; the reply is one result byte.
+ */
+static unsigned char handle_ring(PropClient *c)
 {
-    if (persistent_properties_loaded &&
-            strncmp("persist.", key, strlen("persist.")) == 0) {
-        /* 
-         * Don't write properties to disk until after we have read all default properties
-         * to prevent them from being overwritten by default values.
-         */
-        write_peristent_property(key, value);
-    } else if(memcmp(key,"ctl.",4) == 0) {
-        handle_control_message(key+4, key + PROPERTY_KEY_MAX);
-		return (1);
-	} 
-	
-	return set_property(key, value);
+    struct epoll_event ev;
+    unsigned char result = 0;
+    prop_ring *ring;
+    struct stat sb;
+    int seals;
+
+    if (c->ring != NULL || c->nfds != 2)
+        goto reply;
+
+    /* the client must not be able to shrink the file under us */
+    seals = fcntl(c->fds[0], F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK) ||
+            fstat(c->fds[0], &sb) < 0 || sb.st_size != sizeof(prop_ring))
+        goto reply;
+    ring = mmap(NULL, sizeof(prop_ring), PROT_READ | PROT_WRITE, MAP_SHARED,
+                c->fds[0], 0);
+    if (ring == MAP_FAILED)
+        goto reply;
+    if (ring->magic != PR_MAGIC || ring->slots != PR_SLOTS) {
+        munmap(ring, sizeof(prop_ring));
+        goto reply;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uintptr_t) c | RING_TAG;
+    if (epoll_ctl(prop_epoll_fd, EPOLL_CTL_ADD, c->fds[1], &ev) < 0) {
+        munmap(ring, sizeof(prop_ring));
+        goto reply;
+    }
+
+    c->ring = ring;
+    c->ring_kick = c->fds[1];
+    c->ring_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+    close(c->fds[0]);
+    c->nfds = 0;
+    result = 1;
+
+reply:
+    while (c->nfds > 0)
+        close(c->fds[--c->nfds]);
+    return client_reply(c, &result, 1) == 0;
 }
 
-static unsigned char create_list_file(const char* fileName)
+/*
+ * Apply everything waiting in c's ring, then ask for a kick when more
+ * arrives.  Returns 1 once the ring is empty, 0 if the event ring filled
+ * up first (the client is then stalled), -1 if the ring is corrupt.
+ */
+static int ring_drain(PropClient *c)
 {
+    prop_ring *ring = c->ring;
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    prop_ring_slot *slot;
+    uint32_t tail;
 
-    struct stat sb;
-    unsigned char result = (0);
-    FILE *fp = NULL;
-    int cc;
-	char lineBuf[PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX + 20];
+    if (c->ring_due != 0) {
+        c->ring_due = 0;
+        prop_rings_due--;
+    }
 
-    cc = stat(fileName, &sb);
-    if (cc < 0) {
-        if (errno != ENOENT) {
-            printf(
-                "Unable to stat '%s' (errno=%d)\n", fileName, errno);
-            goto bail;
+    history_pid = c->pid;
+    for (;;) {
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (tail - c->ring_head > PR_SLOTS) {
+            ERROR("property client pid %d corrupted its ring, dropping it\n", c->pid);
+            history_pid = 0;
+            return -1;
         }
-    } else {
-        /* don't touch it if it's not a socket */
-        if (!(S_ISREG(sb.st_mode))) {
-            printf(
-                "File '%s' exists and is not a reg file\n", fileName);
-            goto bail;
+        while (c->ring_head != tail) {
+            if (!event_reserve()) {
+                c->stalled = 1;
+                history_pid = 0;
+                return 0;
+            }
+            slot = &ring->slot[c->ring_head & (PR_SLOTS - 1)];
+            memcpy(key, slot->key, sizeof(key));
+            key[sizeof(key) - 1] = 0;
+            memcpy(value, slot->value, sizeof(value));
+            value[sizeof(value) - 1] = 0;
+            client_set(key, value);
+            __atomic_store_n(&ring->head, ++c->ring_head, __ATOMIC_RELEASE);
         }
 
-        /* remove the cruft */
-        if (unlink(fileName) < 0) {
-            printf(
-                "Unable to remove '%s' (errno=%d)\n", fileName, errno);
-            goto bail;
-        }
-    }	
+        /* whatever lands after this check comes with a kick */
+        __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == tail)
+            break;
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+    }
+    history_pid = 0;
+    return 1;
+}
 
-	fp = fopen(fileName, "w");
+/*
+ * The client kicked its ring.  Unless the ring is filling up, give the
+ * client PROP_RING_DELAY_MS to add more before draining, so that a busy
+ * writer pays for one kick per batch rather than one per update.
+ */
+static void ring_kicked(PropClient *c)
+{
+    uint64_t n;
 
-	struct listnode *node;
-	Property *prop;
+    if (c->fd < 0)
+        return;
+    read(c->ring_kick, &n, sizeof(n));
+    if (c->stalled)
+        return;     /* drained as soon as the main loop catches up */
 
-    list_for_each(node, &prop_list) {
-        prop = node_to_item(node, Property, plist);
-		memset(lineBuf, 0x00, sizeof(lineBuf));
-		sprintf(lineBuf, "%s: [%s]\n", prop->key, prop->value);
-		//printf("%s,%s\n", prop.key, prop.value);
-        fputs(lineBuf, fp);
+    if (__atomic_load_n(&c->ring->tail, __ATOMIC_ACQUIRE) - c->ring_head >= PR_SLOTS / 2) {
+        if (ring_drain(c) < 0)
+            client_close(c);
+        else
+            client_arm(c, 0);
+    } else if (c->ring_due == 0) {
+        c->ring_due = now_ms() + PROP_RING_DELAY_MS;
+        prop_rings_due++;
     }
+}
 
-    if (fp != NULL)
-        fclose(fp);
+static void drain_due_rings(void)
+{
+    struct listnode *node, *next;
+    uint64_t now = now_ms();
+    PropClient *c;
+
+    for (node = client_list.next; node != &client_list; node = next) {
+        next = node->next;
+        c = node_to_item(node, PropClient, clist);
+        if (c->ring_due == 0 || c->ring_due > now)
+            continue;
+        if (ring_drain(c) < 0)
+            client_close(c);
+        else
+            client_arm(c, 0);
+    }
+}
 
-	return (1);
+/*
+ * Run the complete requests waiting in c->in.  Returns 1 if any were
+ * run, 0 if none, -1 if the client should be dropped.
+ */
+static int client_process(PropClient *c)
+{
+    size_t off = 0;
+    ssize_t len;
+    int result = 0;
+
+    /* anything published through the ring was sent before these requests */
+    if (c->ring != NULL && (result = ring_drain(c)) <= 0)
+        return result;
+    result = 0;
+
+    history_pid = c->pid;
+    while (off < c->in_len) {
+        len = request_length(c->in + off, c->in_len - off);
+        if (len < 0) {
+            result = -1;
+            break;
+        }
+        if (len == 0 || (size_t) len > c->in_len - off)
+            break;
+        if (request_sets(c->in + off) && !event_reserve()) {
+            c->stalled = 1;
+            break;
+        }
+        if (!handle_request(c, c->in + off)) {
+            ERROR("property client pid %d not reading replies, dropping it\n", c->pid);
+            result = -1;
+            break;
+        }
+        off += len;
+        result = 1;
+    }
+    history_pid = 0;
 
-bail:
-    if (fp != NULL)
-        fclose(fp);
+    if (off > 0) {
+        memmove(c->in, c->in + off, c->in_len - off);
+        c->in_len -= off;
+    }
     return result;
 }
 
-
-static int create_property_socket(const char* fileName)
+/*
+ * Read what has arrived into c->in.  Descriptors can only come with
+ * kSystemPropertyRing; they are kept until it is handled.
+ */
+static ssize_t client_recv(PropClient *c)
 {
-    struct stat sb;
-    unsigned char result = (0);
-    int sock = -1;
-    int cc;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t actual;
+    int *fds, i, n;
 
-    cc = stat(fileName, &sb);
-    if (cc < 0) {
-        if (errno != ENOENT) {
-            printf(
-                "Unable to stat '%s' (errno=%d)\n", fileName, errno);
-            goto bail;
-        }
-    } else {
-        /* don't touch it if it's not a socket */
-        if (!(S_ISSOCK(sb.st_mode))) {
-            printf(
-                "File '%s' exists and is not a socket\n", fileName);
-            goto bail;
-        }
+    iov.iov_base = c->in + c->in_len;
+    iov.iov_len = sizeof(c->in) - c->in_len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control;
+    msg.msg_controllen = sizeof(control);
 
-        /* remove the cruft */
-        if (unlink(fileName) < 0) {
-            printf(
-                "Unable to remove '%s' (errno=%d)\n", fileName, errno);
-            goto bail;
+    actual = recvmsg(c->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (actual <= 0)
+        return actual;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        fds = (int *) CMSG_DATA(cmsg);
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < n; i++) {
+            if (c->nfds < 2)
+                c->fds[c->nfds++] = fds[i];
+            else
+                close(fds[i]);
         }
     }
+    return actual;
+}
 
-    struct sockaddr_un addr;
+static void client_event(PropClient *c, unsigned events)
+{
+    int progressed = 0, n;
+    ssize_t actual;
 
-    sock = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (sock < 0) {
-        printf(
-            "UNIX domain socket create failed (errno=%d)\n", errno);
-        goto bail;
-    }
+    if (c->fd < 0)
+        return;
 
-    /* bind the socket; this creates the file on disk */
-    strcpy(addr.sun_path, fileName);    // max 108 bytes
-    addr.sun_family = AF_UNIX;
-    cc = bind(sock, (struct sockaddr*) &addr, SUN_LEN(&addr));
-    if (cc < 0) {
-        printf("AF_UNIX bind failed for '%s' (errno=%d)\n", fileName, errno);
-        goto bail;
+    if (events & EPOLLOUT) {
+        if ((n = client_flush(c)) < 0)
+            goto drop;
+        progressed |= n;
     }
 
-    cc = listen(sock, 5);
-    if (cc < 0) {
-        printf("AF_UNIX listen failed (errno=%d)\n", errno);
-        goto bail;
+    if ((events & EPOLLIN) && !c->stalled && c->in_len < sizeof(c->in)) {
+        actual = client_recv(c);
+        if (actual == 0 ||
+                (actual < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            goto drop;
+        if (actual > 0)
+            c->in_len += actual;
+        if ((n = client_process(c)) < 0 || client_flush(c) < 0)
+            goto drop;
+        progressed |= n;
+    } else if (events & (EPOLLHUP | EPOLLERR)) {
+        goto drop;
     }
 
-    result = sock;
-    sock = -1;
-    return result;
+    client_arm(c, progressed);
+    return;
 
-bail:
-    if (sock >= 0)
-        close(sock);
-    return result;
+drop:
+    client_close(c);
 }
 
-
-static unsigned char handle_request(int fd)
+static void accept_clients(void)
 {
-    char reqBuf[PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX];
-    char valueBuf[1 + PROPERTY_VALUE_MAX];
-    ssize_t actual;
+    struct epoll_event ev;
+    struct ucred cred;
+    socklen_t len;
+    PropClient *c;
+    int newSock;
+
+    for (;;) {
+        newSock = accept4(prop_listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (newSock < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                ERROR("AF_UNIX accept failed (errno=%d)\n", errno);
+            if (errno != EINTR)
+                return;
+            continue;
+        }
 
-    memset(valueBuf, 'x', sizeof(valueBuf));        // placate valgrind
+        c = calloc(1, sizeof(*c));
+        if (c == NULL) {
+            close(newSock);
+            continue;
+        }
+        c->fd = newSock;
+        len = sizeof(cred);
+        if (getsockopt(newSock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+            c->pid = cred.pid;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = c->events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(prop_epoll_fd, EPOLL_CTL_ADD, newSock, &ev) < 0) {
+            ERROR("Unable to watch property client (errno=%d)\n", errno);
+            close(newSock);
+            free(c);
+            continue;
+        }
+        list_add_tail(&client_list, &c->clist);
+    }
+}
 
-    /* read the command byte; this determines the message length */
-    actual = read(fd, reqBuf, 1);
-    if (actual <= 0)
-        return (0);
+/* the main loop has made room in the event ring */
+static void resume_clients(void)
+{
+    struct listnode *node, *next;
+    PropClient *c;
+    uint64_t n;
+    int progressed;
+
+    read(prop_wake_fd, &n, sizeof(n));
+
+    for (node = client_list.next; node != &client_list; node = next) {
+        next = node->next;
+        c = node_to_item(node, PropClient, clist);
+        if (!c->stalled)
+            continue;
+        c->stalled = 0;
+        if ((progressed = client_process(c)) < 0 || client_flush(c) < 0)
+            client_close(c);
+        else
+            client_arm(c, progressed);
+    }
+}
 
-    if (reqBuf[0] == kSystemPropertyGet) {
-        actual = read(fd, reqBuf, PROPERTY_KEY_MAX);
+static void expire_clients(void)
+{
+    struct listnode *node, *next;
+    uint64_t now = now_ms();
+    PropClient *c;
+
+    for (node = client_list.next; node != &client_list; node = next) {
+        next = node->next;
+        c = node_to_item(node, PropClient, clist);
+        if (c->deadline != 0 && c->deadline <= now) {
+            ERROR("property client pid %d timed out, dropping it\n", c->pid);
+            client_close(c);
+        }
+    }
+}
 
-        if (actual != PROPERTY_KEY_MAX) {
-            fprintf(stderr, "Bad read on get: %d of %d\n",
-                (int) actual, PROPERTY_KEY_MAX);
-            return (0);
+static void *property_service_thread(void *arg)
+{
+    struct epoll_event events[PROP_MAX_EVENTS];
+    uint64_t next_sweep = 0, one = 1;
+    PropClient *c;
+    int i, nr, timeout;
+
+    for (;;) {
+        pthread_mutex_lock(&prop_lock);
+        timeout = prop_timed_clients ? PROP_SWEEP_MS : -1;
+        if (prop_rings_due)
+            timeout = PROP_RING_DELAY_MS;
+        pthread_mutex_unlock(&prop_lock);
+
+        nr = epoll_wait(prop_epoll_fd, events, PROP_MAX_EVENTS, timeout);
+        if (nr < 0 && errno != EINTR) {
+            ERROR("property service epoll failed (errno=%d)\n", errno);
+            return NULL;
         }
-        if (get_property(reqBuf, valueBuf+1))
-            valueBuf[0] = 1;
-        else
-            valueBuf[0] = 0;
-        //printf("GET property [%s]: (found=%d) [%s]\n",
-        //    reqBuf, valueBuf[0], valueBuf+1);
-        if (write(fd, valueBuf, sizeof(valueBuf)) != sizeof(valueBuf)) {
-            fprintf(stderr, "Bad write on get\n");
-            return (0);
+
+        pthread_mutex_lock(&prop_lock);
+        for (i = 0; i < nr; i++) {
+            if (events[i].data.ptr == &prop_listen_fd)
+                accept_clients();
+            else if (events[i].data.ptr == &prop_wake_fd)
+                resume_clients();
+            else if (events[i].data.u64 & RING_TAG)
+                ring_kicked((PropClient *) (uintptr_t) (events[i].data.u64 & ~RING_TAG));
+            else
+                client_event(events[i].data.ptr, events[i].events);
         }
-    } else if (reqBuf[0] == kSystemPropertySet) {
-        actual = read(fd, reqBuf, PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX);
-        if (actual != PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX) {
-            fprintf(stderr, "Bad read on set: %d of %d\n",
-                (int) actual, PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX);
-            return (0);
+        if (prop_rings_due)
+            drain_due_rings();
+        if (prop_timed_clients && now_ms() >= next_sweep) {
+            expire_clients();
+            next_sweep = now_ms() + PROP_SWEEP_MS;
         }
-        //printf("SET property '%s'\n", reqBuf);
-
-       	if (property_set(reqBuf, reqBuf + PROPERTY_KEY_MAX))
-           	valueBuf[0] = 1;
-       	else
-           	valueBuf[0] = 0;
+        while (!list_empty(&closed_list)) {
+            c = node_to_item(list_head(&closed_list), PropClient, clist);
+            list_remove(&c->clist);
+            free(c->out);
+            free(c);
+        }
+        pthread_mutex_unlock(&prop_lock);
 
-        if (write(fd, valueBuf, 1) != 1) {
-            fprintf(stderr, "Bad write on set\n");
-            return (0);
+        if (events_posted) {
+            events_posted = 0;
+            write(event_fd, &one, sizeof(one));
         }
-    } else if (reqBuf[0] == kSystemPropertyList) {
-        /* TODO */
-        //assert(false);
-		create_list_file(SYSTEM_PROPERTY_LIST_NAME);
-        valueBuf[0] = 1;
-        if (write(fd, valueBuf, 1) != 1) {
-            fprintf(stderr, "Bad write on set\n");
-            return (0);
-        }			
-    } else {
-        fprintf(stderr, "Unexpected request %d from prop client\n", reqBuf[0]);
-        return (0);
     }
-
-    return (1);
+    return NULL;
 }
 
+/*
+ * Called by init's main loop when the descriptor start_property_service
+ * returned is readable: act on the control messages and property triggers
+ * the service thread has passed over.
+ */
 void handle_property_set_fd(int fd)
 {
-            struct sockaddr_un from;
-            socklen_t fromlen;
-            int newSock;
-
-            fromlen = sizeof(from);
-            newSock = accept(fd, (struct sockaddr*) &from, &fromlen);
-            if (newSock < 0) {
-                printf(
-                    "AF_UNIX accept failed (errno=%d)\n", errno);
-            } else {
-                //printf("new props connection on %d --> %d\n",
-                //    mListenSock, newSock);
-            }
+    unsigned head, tail;
+    const PropEvent *e;
+    const char *value;
+    uint64_t n;
+
+    read(fd, &n, sizeof(n));
+
+    head = event_head;
+    tail = __atomic_load_n(&event_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        e = &event_ring[head & (PROP_EVENT_RING - 1)];
+        value = e->long_value ? e->long_value : e->value;
+        if (e->type == PROP_EVENT_CONTROL)
+            handle_control_message(e->key + 4, value);
+        else
+            queue_property_triggers(e->key, value);
+        free(e->long_value);
+        __atomic_store_n(&event_head, ++head, __ATOMIC_SEQ_CST);
+    }
 
+    if (__atomic_exchange_n(&event_stalled, 0, __ATOMIC_SEQ_CST))
+        wake_service();
+}
 
-            unsigned char ok = (1);
+/*
+ * Property files are mapped and parsed in place: each key=value line is
+ * recorded as a pair of ranges into the mapping, and the file is never
+ * modified.  Once the whole file has been scanned, a line whose key turns
+ * up again further down is dropped (the last one wins, as it always has).
+ * Only the lines that survive are copied out, into one buffer, as the
+ * strings the store is set from; they are then applied as one batch.
+ */
+struct prop_line {
+    const char *key;
+    const char *value;
+    unsigned klen;
+    unsigned vlen;
+};
+
+static unsigned hash_bytes(const char *p, unsigned len)
+{
+    uint32_t h = 2166136261u;
 
+    while (len--) {
+        h ^= (unsigned char) *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
 
-            ok = handle_request(newSock);
+static void trim(const char **start, const char **end)
+{
+    while (*start < *end && isspace((unsigned char) **start))
+        (*start)++;
+    while (*end > *start && isspace((unsigned char) (*end)[-1]))
+        (*end)--;
+}
 
-            if (ok) {
+/* returns the number of lines, or -1 */
+static int parse_prop_lines(const char *data, size_t size, struct prop_line **_lines)
+{
+    const char *sol, *eol, *eq, *end = data + size;
+    const char *key, *key_end, *value, *value_end;
+    struct prop_line *lines = NULL, *tmp;
+    int count = 0, alloc = 0;
+
+    for (sol = data; sol < end; sol = eol + 1) {
+        eol = memchr(sol, '\n', end - sol);
+        if (eol == NULL)
+            eol = end;
+
+        eq = memchr(sol, '=', eol - sol);
+        if (eq == NULL)
+            continue;
+        key = sol;
+        key_end = eq;
+        trim(&key, &key_end);
+        if (key < key_end && *key == '#')
+            continue;
+        value = eq + 1;
+        value_end = eol;
+        trim(&value, &value_end);
+
+        if (key == key_end || key_end - key >= PROPERTY_KEY_MAX ||
+                value_end - value >= PROPERTY_LONG_VALUE_MAX) {
+            ERROR("ignoring property line '%.*s'\n", (int) (eol - sol), sol);
+            continue;
+        }
 
-            } else {
-                //printf("--- closing %d\n", fd);
-                close(newSock);
+        if (count == alloc) {
+            alloc = alloc ? alloc * 2 : 256;
+            tmp = realloc(lines, alloc * sizeof(*lines));
+            if (tmp == NULL) {
+                free(lines);
+                return -1;
             }
+            lines = tmp;
+        }
+        lines[count].key = key;
+        lines[count].klen = key_end - key;
+        lines[count].value = value;
+        lines[count].vlen = value_end - value;
+        count++;
+    }
+
+    *_lines = lines;
+    return count;
 }
 
-static void load_properties(char *data)
+/*
+ * Walk the lines backwards, marking (klen = 0) any whose key has already
+ * been seen.  ctl.* lines are commands rather than values, so every one
+ * of them is kept.  Returns the number left, or -1.
+ */
+static int drop_duplicate_lines(struct prop_line *lines, int count)
 {
-    char *key, *value, *eol, *sol, *tmp;
+    struct prop_line **seen, *other;
+    unsigned size, mask, i;
+    int n, live = 0;
+
+    for (size = 16; size < (unsigned) count * 2; size *= 2)
+        ;
+    seen = calloc(size, sizeof(*seen));
+    if (seen == NULL)
+        return -1;
+    mask = size - 1;
+
+    for (n = count - 1; n >= 0; n--) {
+        if (lines[n].klen >= 4 && memcmp(lines[n].key, "ctl.", 4) == 0) {
+            live++;
+            continue;
+        }
+        i = hash_bytes(lines[n].key, lines[n].klen) & mask;
+        for (; (other = seen[i]) != NULL; i = (i + 1) & mask) {
+            if (other->klen == lines[n].klen &&
+                    memcmp(other->key, lines[n].key, other->klen) == 0)
+                break;
+        }
+        if (other != NULL) {
+            lines[n].klen = 0;
+        } else {
+            seen[i] = &lines[n];
+            live++;
+        }
+    }
 
-    sol = data;
-    while((eol = strchr(sol, '\n'))) {
-        key = sol;
-        *eol++ = 0;
-        sol = eol;
+    free(seen);
+    return live;
+}
 
-        value = strchr(key, '=');
-        if(value == 0) continue;
-        *value++ = 0;
+/*
+ * Copy the surviving lines into a single allocation as strings, then
+ * apply all of them with one store_set_batch, the way a client's commit
+ * is applied, rather than taking the lock and publishing once per line.
+ * Frozen keys are skipped, as set_property would refuse them anyway.
+ * ctl.* lines aren't stored: they run through property_set once the
+ * batch is in, in file order among themselves, so each of them sees
+ * every property the file sets (see load_props in readme.txt).
+ */
+int property_load_file(const char *fn)
+{
+    struct prop_line *lines = NULL;
+    PropStaged *staged = NULL;
+    char *text = NULL, *p;
+    struct stat sb;
+    size_t size = 0;
+    char *data;
+    int fd, count, live, i, n = 0, result;
+
+    fd = open(fn, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &sb) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (sb.st_size == 0) {
+        close(fd);
+        return 0;
+    }
 
-        while(isspace(*key)) key++;
-        if(*key == '#') continue;
-        tmp = value - 2;
-        while((tmp > key) && isspace(*tmp)) *tmp-- = 0;
+    data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        ERROR("Unable to map %s errno: %d\n", fn, errno);
+        return -1;
+    }
 
-        while(isspace(*value)) value++;
-        tmp = eol - 2;
-        while((tmp > value) && isspace(*tmp)) *tmp-- = 0;
+    count = parse_prop_lines(data, sb.st_size, &lines);
+    live = count > 0 ? drop_duplicate_lines(lines, count) : count;
+    result = live;
+    if (live <= 0)
+        goto out;
 
-        property_set(key, value);
+    for (i = 0; i < count; i++) {
+        if (lines[i].klen != 0)
+            size += lines[i].klen + lines[i].vlen + 2;
+    }
+    text = malloc(size);
+    staged = malloc(live * sizeof(*staged));
+    if (text == NULL || staged == NULL) {
+        result = -1;
+        goto out;
     }
-}
 
-static void load_properties_from_file(const char *fn)
-{
-    char *data;
-    unsigned sz;
+    p = text;
+    for (i = 0; i < count; i++) {
+        if (lines[i].klen == 0)
+            continue;
+        memcpy(p, lines[i].key, lines[i].klen);
+        p[lines[i].klen] = 0;
+        lines[i].key = p;
+        p += lines[i].klen + 1;
+        memcpy(p, lines[i].value, lines[i].vlen);
+        p[lines[i].vlen] = 0;
+        lines[i].value = p;
+        p += lines[i].vlen + 1;
+    }
 
-    data = read_file(fn, &sz);
+    pthread_mutex_lock(&prop_lock);
+    for (i = 0; i < count; i++) {
+        if (lines[i].klen == 0 || strncmp(lines[i].key, "ctl.", 4) == 0 ||
+                prop_frozen(lines[i].key, pa_hash(lines[i].key)))
+            continue;
+        staged[n].key = lines[i].key;
+        staged[n].value = lines[i].value;
+        n++;
+    }
+    if (n > 0 && store_set_batch(staged, n) < 0) {
+        ERROR("Unable to load properties from %s\n", fn);
+        result = -1;
+        n = 0;
+    }
+    pthread_mutex_unlock(&prop_lock);
 
-    if(data != 0) {
-        load_properties(data);
-        free(data);
+    for (i = 0; i < n; i++)
+        queue_property_triggers(staged[i].key, staged[i].value);
+    for (i = 0; i < count; i++) {
+        if (lines[i].klen != 0 && strncmp(lines[i].key, "ctl.", 4) == 0)
+            property_set(lines[i].key, lines[i].value);
     }
+
+out:
+    free(staged);
+    free(text);
+    free(lines);
+    munmap(data, sb.st_size);
+    return result;
 }
 
 static void load_persistent_properties()
 {
-    DIR* dir = opendir(PERSISTENT_PROPERTY_DIR);
-    struct dirent*  entry;
-    char path[PATH_MAX];
-    char value[PROPERTY_VALUE_MAX];
-    int fd, length;
-
-    if (dir) {
-        while ((entry = readdir(dir)) != NULL) {
-            if (strncmp("persist.", entry->d_name, strlen("persist.")))
-                continue;
-#if HAVE_DIRENT_D_TYPE
-            if (entry->d_type != DT_REG)
-                continue;
-#endif
-            /* open the file and read the property value */
-            snprintf(path, sizeof(path), "%s/%s", PERSISTENT_PROPERTY_DIR, entry->d_name);
-            fd = open(path, O_RDONLY);
-            if (fd >= 0) {
-                length = read(fd, value, sizeof(value) - 1);
-                if (length >= 0) {
-                    value[length] = 0;
-                    property_set(entry->d_name, value);
-                } else {
-                    ERROR("Unable to read persistent property file %s errno: %d\n", path, errno);
-                }
-                close(fd);
-            } else {
-                ERROR("Unable to open persistent property file %s errno: %d\n", path, errno);
-            }
-        }
-        closedir(dir);
-    } else {
-        ERROR("Unable to open persistent property directory %s errno: %d\n", PERSISTENT_PROPERTY_DIR, errno);
-    }
-    
+    persist_load(set_property);
     persistent_properties_loaded = 1;
 }
 
@@ -453,20 +2465,73 @@ static void set_default_properties(void)
 
 void property_init(void)
 {
+    history_self = getpid();
+    init_property_area();
     set_default_properties();
-	load_properties_from_file(PROP_PATH_SYSTEM_DEFAULT);
+	property_load_file(PROP_PATH_SYSTEM_DEFAULT);
 }
 
+/*
+ * Start the service thread.  Returns the descriptor init's main loop
+ * should poll, handing it to handle_property_set_fd when it is readable.
+ */
 int start_property_service(void)
 {
+    struct epoll_event ev;
+    sigset_t all, old;
     int fd = create_property_socket(SYSTEM_PROPERTY_PIPE_NAME);
     /* Read persistent properties after all default values have been loaded. */
     load_persistent_properties();
+    freeze_ro_properties();
 
     if(fd < 0) return -1;
     fcntl(fd, F_SETFD, FD_CLOEXEC);
     fcntl(fd, F_SETFL, O_NONBLOCK);
 
+    prop_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    prop_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (prop_epoll_fd < 0 || prop_wake_fd < 0 || event_fd < 0) {
+        ERROR("Unable to set up the property service (errno=%d)\n", errno);
+        goto fail;
+    }
 
-    return fd;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &prop_listen_fd;
+    if (epoll_ctl(prop_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        ERROR("Unable to watch property socket (errno=%d)\n", errno);
+        goto fail;
+    }
+    ev.data.ptr = &prop_wake_fd;
+    if (epoll_ctl(prop_epoll_fd, EPOLL_CTL_ADD, prop_wake_fd, &ev) < 0) {
+        ERROR("Unable to watch property wakeups (errno=%d)\n", errno);
+        goto fail;
+    }
+    prop_listen_fd = fd;
+
+    /* signals are for the main loop; the thread inherits this mask */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&prop_thread, NULL, property_service_thread, NULL) != 0) {
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        ERROR("Unable to start the property service thread\n");
+        prop_listen_fd = -1;
+        goto fail;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_detach(prop_thread);
+
+    return event_fd;
+
+fail:
+    if (event_fd >= 0)
+        close(event_fd);
+    if (prop_wake_fd >= 0)
+        close(prop_wake_fd);
+    if (prop_epoll_fd >= 0)
+        close(prop_epoll_fd);
+    close(fd);
+    event_fd = prop_wake_fd = prop_epoll_fd = -1;
+    return -1;
 }
@@ -6,28 +6,56 @@
 
 #define PROPERTY_KEY_MAX   32
 #define PROPERTY_VALUE_MAX  92
+#define PROPERTY_BATCH_MAX  64      /* keys per GetMany/SetMany frame */
+#define PROPERTY_LONG_VALUE_MAX 4096    /* v2 frames; kept out of line */
+#define PROPERTY_COMMIT_MAX 8192    /* bytes in one commit frame */
 
+#define PROPERTY_PROTOCOL_VERSION   2
+
+#ifndef SYSTEM_PROPERTY_PIPE_NAME
 #define SYSTEM_PROPERTY_PIPE_NAME       "/tmp/linux-sysprop"
-#define SYSTEM_PROPERTY_LIST_NAME       "/tmp/linux-sysprop-list"
+#endif
+
+#include "prop_area.h"
 
 enum {
     kSystemPropertyUnknown = 0,
     kSystemPropertyGet,
     kSystemPropertySet,
-    kSystemPropertyList
+    kSystemPropertyList,
+    kSystemPropertyGetMany,
+    kSystemPropertySetMany,
+    kSystemPropertyWatch,
+    kSystemPropertyNotify,
+    kSystemPropertyHello,
+    kSystemPropertyGetV2,
+    kSystemPropertySetV2,
+    kSystemPropertyHistory,
+    kSystemPropertyCommit,
+    kSystemPropertyRing
 };
 
 /* one property entry */
 typedef struct property {
     char    key[PROPERTY_KEY_MAX];
-    char    value[PROPERTY_VALUE_MAX];
+    char    value[PROPERTY_VALUE_MAX];  /* truncated if long_value is set */
+    char    *long_value;    /* full value when it doesn't fit in value */
+    unsigned hash;
+    prop_info *pi;      /* mirror in the shared area, NULL if it is full */
 
-	struct listnode plist;
+	struct listnode plist;  /* the slab free list */
 }Property;
 
 
-void handle_property_set_fd(int listen_sock);
+void handle_property_set_fd(int fd);
 int start_property_service(void);
 void property_init(void);
 unsigned char property_set(const char *key, const char *value);
+int property_get(const char *name, char *value, size_t size);
+int property_load_file(const char *fn);
+/* walks the store unlocked: only for use before the service starts or
+ * in a child forked while holding the store lock (persist.c) */
+void property_foreach(const char *prefix,
+                      void (*fn)(const char *key, const char *value, void *cookie),
+                      void *cookie);
 #endif//_PROPD_H
\ No newline at end of file
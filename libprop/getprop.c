@@ -4,42 +4,21 @@
 #include <stdlib.h>
 
 #include "properties.h"
-/*
+
 static void proplist(const char *key, const char *name, 
                      void *user __attribute__((unused)))
 {
     printf("[%s]: [%s]\n", key, name);
 }
-*/
 
-#define PATH_MAX 4096
-static void get_property_list(void)
+static void printchange(const property_change *change,
+                        void *user __attribute__((unused)))
 {
-	char path[PATH_MAX];
-	memset(path, 0x00, sizeof(path));
-	property_list(path);
-
-	//printf("%s\n", path);
-
-	if(access(path, F_OK) == 0) {
-	    FILE * fp;
-        char * line = NULL;
-        size_t len = 0;
-        ssize_t read;
-
-	    fp = fopen(path, "r");
-        if (fp == NULL)
-		    return;
-	    while ((read = getline(&line, &len, fp)) != -1)
-	    {
-    	    //printf("Retrieved line of length %zu :\n", read);
-    	    printf("%s", line);
-        }
-	    if (line)
-            free(line);
-
-		//unlink(path);
-	}
+    printf("[%5llu.%06llu] pid %d: %s [%s] -> [%s]\n",
+           change->time_ns / 1000000000, change->time_ns / 1000 % 1000000,
+           change->pid, change->key,
+           change->old_value ? change->old_value : "(unset)",
+           change->new_value ? change->new_value : "(unset)");
 }
 
 int main(int argc, char *argv[])
@@ -47,9 +26,23 @@ int main(int argc, char *argv[])
     int n = 0;
 
     if (argc == 1) {
-        (void)get_property_list();
+        (void)property_list(proplist, NULL);
+    } else if (strcmp(argv[1], "-p") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "usage: getprop -p <prefix>\n");
+            return 1;
+        }
+        if (property_list_prefix(argv[2], proplist, NULL) < 0) {
+            fprintf(stderr, "could not list properties\n");
+            return 1;
+        }
+    } else if (strcmp(argv[1], "--history") == 0) {
+        if (property_history(printchange, NULL) < 0) {
+            fprintf(stderr, "could not read property history\n");
+            return 1;
+        }
     } else {
-        char value[PROPERTY_VALUE_MAX];
+        char value[PROPERTY_LONG_VALUE_MAX];
         char *default_value;
         if(argc > 2) {
             default_value = argv[2];
@@ -57,9 +50,8 @@ int main(int argc, char *argv[])
             default_value = "";
         }
 
-        property_get(argv[1], value, default_value);
+        property_get_long(argv[1], value, sizeof(value), default_value);
         printf("%s\n", value);
     }
     return 0;
 }
-
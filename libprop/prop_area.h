@@ -0,0 +1,80 @@
+#ifndef __PROP_AREA_H
+#define __PROP_AREA_H
+
+/*
+ * Layout of the shared, memory-mapped property area.
+ *
+ * propd is the only writer: it creates the file, maps it read/write and
+ * mirrors every property it stores into a prop_info slot.  Clients map the
+ * same file read-only and resolve property_get() without talking to the
+ * server.  Include this after PROPERTY_KEY_MAX and PROPERTY_VALUE_MAX are
+ * defined (properties.h or propd.h).
+ *
+ * Slots are never reused for a different name, so once a reader has found
+ * a slot through the index its name is stable.  Each slot's value is
+ * protected by its own sequence counter: the writer makes the serial odd,
+ * updates the value and flags, then makes it even again.  A reader copies
+ * the value and retries if the serial was odd or changed underneath it.
+ *
+ * An atomic commit of several properties is bracketed the same way by the
+ * area's commit counter, so that no reader sees some of its values
+ * without the rest: readers also retry while it is odd or if it moved.
+ */
+
+#include <stdint.h>
+
+#ifndef SYSTEM_PROPERTY_AREA_NAME
+#define SYSTEM_PROPERTY_AREA_NAME       "/tmp/linux-sysprop-area"
+#endif
+
+#define PA_MAGIC            0x504f5250  /* "PROP" */
+#define PA_VERSION          2
+
+/*
+ * Room for several thousand distinct properties (about 1MB of slots).
+ * Pages are only touched as slots are handed out, so an area that holds
+ * a few hundred costs no more than a small one would.
+ */
+#define PA_COUNT_MAX        8192        /* property slots */
+#define PA_INDEX_SIZE       16384       /* hash index, power of two */
+
+/* prop_info.flags */
+#define PI_DELETED          0x01        /* property has been removed */
+#define PI_LONG             0x02        /* value is truncated; ask propd */
+
+typedef struct prop_info {
+    char name[PROPERTY_KEY_MAX];
+    volatile uint32_t serial;           /* odd while the writer is busy */
+    volatile uint32_t flags;
+    char value[PROPERTY_VALUE_MAX];
+} prop_info;
+
+typedef struct prop_area {
+    uint32_t magic;
+    uint32_t version;
+    volatile uint32_t serial;           /* bumped on every change */
+    volatile uint32_t count;            /* slots handed out */
+    volatile uint32_t overflow;         /* some property did not fit */
+    volatile uint32_t stale;            /* propd restarted; remap */
+    volatile uint32_t commit;           /* odd while a commit is published */
+    uint32_t reserved[1];
+
+    /* open addressing, linear probing; slot number + 1, 0 is empty */
+    volatile uint16_t index[PA_INDEX_SIZE];
+
+    prop_info info[PA_COUNT_MAX];
+} prop_area;
+
+/* FNV-1a; must match between propd and every client */
+static inline uint32_t pa_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef __PROP_RING_H
+#define __PROP_RING_H
+
+/*
+ * Layout of the ring a client process hands propd for property_publish.
+ *
+ * The client creates it in a sealed memfd and passes that, together with
+ * an eventfd, over its connection with kSystemPropertyRing.  The client's
+ * threads take turns producing, under a lock of their own; propd is the
+ * only consumer.  Each side owns one index and publishes it with release
+ * ordering.  propd treats everything in the ring as untrusted: it keeps
+ * its own copy of head and checks what it reads.
+ *
+ * The eventfd is only written when propd has asked for it by setting
+ * waiting, which it does once it has drained the ring, or when the ring
+ * reaches half full.  Between drains, producers make no system calls.
+ * Include this after PROPERTY_KEY_MAX and PROPERTY_VALUE_MAX are defined
+ * (properties.h or propd.h).
+ */
+
+#include <stdint.h>
+
+#define PR_MAGIC            0x474e5250  /* "PRNG" */
+#define PR_SLOTS            256         /* power of two */
+
+typedef struct prop_ring_slot {
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+} prop_ring_slot;
+
+typedef struct prop_ring {
+    uint32_t magic;
+    uint32_t slots;
+    volatile uint32_t head;             /* next slot propd reads */
+    volatile uint32_t tail;             /* next slot the client fills */
+    volatile uint32_t waiting;          /* propd wants the eventfd kicked */
+    uint32_t reserved[3];
+
+    prop_ring_slot slot[PR_SLOTS];
+} prop_ring;
+
+#endif
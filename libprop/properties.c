@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE     /* memfd_create, file seals */
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -22,22 +23,41 @@
 #include <assert.h>
 
 #include "properties.h"
+#include "prop_area.h"
+#include "prop_ring.h"
 
 /*
  * The Linux simulator provides a "system property server" that uses IPC
- * to set/get/list properties.  The file descriptor is shared by all
- * threads in the process, so we use a mutex to ensure that requests
- * from multiple threads don't get interleaved.
+ * to set/get/list properties.  Each thread lazily opens a connection of
+ * its own, so requests from different threads never wait on each other,
+ * and a connection the server dropped (e.g. init restarted) is reopened
+ * and the request retried once.
+ *
+ * Reads normally don't touch the socket at all: the server publishes
+ * every property into a shared area that we map read-only.
  */
 #include <stdio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <sys/un.h>
 #include <pthread.h>
+#include <sched.h>
 
 static pthread_once_t gInitOnce = PTHREAD_ONCE_INIT;
-static pthread_mutex_t gPropertyFdLock = PTHREAD_MUTEX_INITIALIZER;
-static int gPropFd = -1;
+static pthread_key_t gConnKey;          /* closes a thread's connection */
+static __thread int tPropFd = -1;
+static __thread int tPropVersion;       /* protocol spoken on tPropFd */
+
+static pthread_mutex_t gAreaLock = PTHREAD_MUTEX_INITIALIZER;
+static const prop_area *volatile gArea = NULL;
+
+static const prop_area *mapArea(const char *fileName);
 
 /*
  * Connect to the properties server.
@@ -73,165 +93,1759 @@ static int connectToServer(const char* fileName)
     return sock;
 }
 
+/*
+ * Read or write exactly len bytes on the server connection.
+ */
+static int readFully(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t actual;
+
+    while (len > 0) {
+        actual = read(fd, p, len);
+        if (actual < 0 && errno == EINTR)
+            continue;
+        if (actual <= 0)
+            return -1;
+        p += actual;
+        len -= actual;
+    }
+    return 0;
+}
+
+static int writeFully(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t actual;
+
+    while (len > 0) {
+        actual = send(fd, p, len, MSG_NOSIGNAL);
+        if (actual < 0 && errno == EINTR)
+            continue;
+        if (actual <= 0)
+            return -1;
+        p += actual;
+        len -= actual;
+    }
+    return 0;
+}
+
+/*
+ * Connect and agree on a protocol version.  A v1 server hangs up on the
+ * hello, in which case we connect again and stick to v1 frames.
+ *
+ * Returns the socket, or -1 if the server can't be reached.
+ */
+static int connectAndNegotiate(int *version)
+{
+    unsigned char buf[2] = { kSystemPropertyHello, PROPERTY_PROTOCOL_VERSION };
+    int fd;
+
+    fd = connectToServer(SYSTEM_PROPERTY_PIPE_NAME);
+    if (fd < 0)
+        return -1;
+    if (writeFully(fd, buf, 2) == 0 && readFully(fd, buf, 2) == 0 &&
+            buf[0] == kSystemPropertyHello && buf[1] >= 1) {
+        *version = buf[1];
+        return fd;
+    }
+    close(fd);
+
+    *version = 1;
+    return connectToServer(SYSTEM_PROPERTY_PIPE_NAME);
+}
+
+/*
+ * The calling thread's connection to the server, opened on first use.
+ *
+ * Returns -1 if the server can't be reached.
+ */
+static int getConnection(void)
+{
+    if (tPropFd < 0) {
+        tPropFd = connectAndNegotiate(&tPropVersion);
+        if (tPropFd < 0) {
+            //LOGW("not connected to system property server\n");
+            return -1;
+        }
+        pthread_setspecific(gConnKey, (void *) (intptr_t) (tPropFd + 1));
+
+        /* propd may have come up after us; its area exists by now */
+        if (gArea == NULL) {
+            pthread_mutex_lock(&gAreaLock);
+            if (gArea == NULL)
+                gArea = mapArea(SYSTEM_PROPERTY_AREA_NAME);
+            pthread_mutex_unlock(&gAreaLock);
+        }
+    }
+    return tPropFd;
+}
+
+static void dropConnection(void)
+{
+    if (tPropFd >= 0) {
+        close(tPropFd);
+        tPropFd = -1;
+        pthread_setspecific(gConnKey, NULL);
+    }
+}
+
+static void closeConnection(void *value)
+{
+    close((int) (intptr_t) value - 1);
+}
+
+/*
+ * Send a request and read a reply of known length.  If the connection
+ * turns out to be dead, reconnect and try once more.
+ */
+static int transact(const void *req, size_t reqlen, void *reply, size_t replylen)
+{
+    int attempt, fd;
+
+    for (attempt = 0; attempt < 2; attempt++) {
+        fd = getConnection();
+        if (fd < 0)
+            return -1;
+        if (writeFully(fd, req, reqlen) == 0 &&
+                readFully(fd, reply, replylen) == 0)
+            return 0;
+        dropConnection();
+    }
+    return -1;
+}
+
+/*
+ * Map the shared property area read-only.
+ *
+ * Returns NULL if the server hasn't created one.
+ */
+static const prop_area *mapArea(const char* fileName)
+{
+    struct stat sb;
+    prop_area *area;
+    int fd;
+
+    fd = open(fileName, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &sb) < 0 || sb.st_size != sizeof(prop_area)) {
+        close(fd);
+        return NULL;
+    }
+
+    area = mmap(NULL, sizeof(prop_area), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (area == MAP_FAILED)
+        return NULL;
+
+    if (__atomic_load_n(&area->magic, __ATOMIC_ACQUIRE) != PA_MAGIC ||
+            area->version != PA_VERSION) {
+        munmap(area, sizeof(prop_area));
+        return NULL;
+    }
+    return area;
+}
+
+/*
+ * Return the current area, remapping if the server has replaced it.  The
+ * old mapping is deliberately leaked since other threads may still be
+ * reading from it.
+ */
+static const prop_area *getArea(void)
+{
+    const prop_area *area = gArea;
+
+    if (area == NULL || !__atomic_load_n(&area->stale, __ATOMIC_ACQUIRE))
+        return area;
+
+    pthread_mutex_lock(&gAreaLock);
+    if (gArea == area)
+        gArea = mapArea(SYSTEM_PROPERTY_AREA_NAME);
+    area = gArea;
+    pthread_mutex_unlock(&gAreaLock);
+    return area;
+}
+
+/*
+ * Where a value came from, so a cached copy can be checked later: the
+ * serial of the property's slot in the area, or for keys the area doesn't
+ * hold, the area's global serial from before the lookup.
+ */
+typedef struct CacheStamp {
+    const prop_area *area;
+    const prop_info *pi;
+    uint32_t serial;
+    uint32_t flags;         /* the slot's flags as of serial */
+} CacheStamp;
+
+/*
+ * Readers retry while propd is in the middle of a write, which takes it
+ * microseconds.  If the area stays busy much longer than that, propd has
+ * most likely died or been stopped mid-update: give up and let the caller
+ * ask over the socket, which fails cleanly in that case.
+ */
+#define AREA_RETRY_MAX      4096
+#define AREA_SPIN_MAX       64      /* then yield between tries */
+
+static void areaPause(unsigned tries)
+{
+    if (tries >= AREA_SPIN_MAX) {
+        sched_yield();
+        return;
+    }
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/*
+ * Look key up in the shared area.
+ *
+ * Returns 1 and fills in value if the property is set, 0 if it is known
+ * not to be, and -1 if the area can't answer and the server must be asked.
+ */
+static int areaGet(const prop_area *area, const char *key, char *value,
+                   CacheStamp *stamp)
+{
+    unsigned mask = PA_INDEX_SIZE - 1;
+    const prop_info *pi = NULL;
+    uint32_t serial, flags, commit;
+    unsigned i, n, slot, tries;
+
+    stamp->area = area;
+    stamp->pi = NULL;
+    stamp->flags = 0;
+    stamp->serial = __atomic_load_n(&area->serial, __ATOMIC_ACQUIRE);
+
+    for (i = pa_hash(key) & mask, n = 0; n < PA_INDEX_SIZE; i = (i + 1) & mask, n++) {
+        slot = __atomic_load_n(&area->index[i], __ATOMIC_ACQUIRE);
+        if (slot == 0)
+            break;
+        if (strcmp(area->info[slot - 1].name, key) == 0) {
+            pi = &area->info[slot - 1];
+            break;
+        }
+    }
+
+    if (pi == NULL)
+        return __atomic_load_n(&area->overflow, __ATOMIC_ACQUIRE) ? -1 : 0;
+
+    for (tries = 0; ; areaPause(tries++)) {
+        if (tries == AREA_RETRY_MAX)
+            return -1;
+        commit = __atomic_load_n(&area->commit, __ATOMIC_ACQUIRE);
+        serial = __atomic_load_n(&pi->serial, __ATOMIC_ACQUIRE);
+        if ((serial | commit) & 1)
+            continue;
+        memcpy(value, pi->value, PROPERTY_VALUE_MAX);
+        flags = pi->flags;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&pi->serial, __ATOMIC_RELAXED) == serial &&
+                __atomic_load_n(&area->commit, __ATOMIC_RELAXED) == commit)
+            break;
+    }
+    value[PROPERTY_VALUE_MAX - 1] = '\0';
+
+    stamp->pi = pi;
+    stamp->serial = serial;
+    stamp->flags = flags;
+    return (flags & PI_DELETED) ? 0 : 1;
+}
+
+/*
+ * Optional per-thread cache of property_get results, direct-mapped by key
+ * hash.  ro.* values never change once set and are kept for good; anything
+ * else is only used while its CacheStamp still matches the shared area,
+ * so a hit costs no IPC and at most one load from the area.
+ */
+#define CACHE_SLOTS 64      /* power of two */
+
+typedef struct CacheEntry {
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    unsigned char valid;
+    unsigned char found;
+    CacheStamp stamp;
+} CacheEntry;
+
+static volatile int gCacheEnabled = 0;
+static __thread CacheEntry tCache[CACHE_SLOTS];
+
+void property_cache_enable(int enable)
+{
+    gCacheEnabled = enable;
+}
+
+static int isReadOnly(const char *key)
+{
+    return strncmp(key, "ro.", 3) == 0;
+}
+
+/* returns 1 or 0 (found or not) on a valid hit, -1 on a miss */
+static int cacheGet(const char *key, char *value)
+{
+    CacheEntry *e = &tCache[pa_hash(key) & (CACHE_SLOTS - 1)];
+    const prop_area *area;
+    uint32_t serial;
+
+    if (!e->valid || strcmp(e->key, key) != 0)
+        return -1;
+
+    if (!(e->found && isReadOnly(key))) {
+        area = getArea();
+        if (area == NULL || area != e->stamp.area)
+            return -1;
+        if (e->stamp.pi != NULL)
+            serial = __atomic_load_n(&e->stamp.pi->serial, __ATOMIC_ACQUIRE);
+        else
+            serial = __atomic_load_n(&area->serial, __ATOMIC_ACQUIRE);
+        if (serial != e->stamp.serial)
+            return -1;
+    }
+
+    if (e->found)
+        strcpy(value, e->value);
+    return e->found;
+}
+
+static void cachePut(const char *key, int found, const char *value,
+                     const CacheStamp *stamp)
+{
+    CacheEntry *e = &tCache[pa_hash(key) & (CACHE_SLOTS - 1)];
+
+    /* nothing to validate against; only a set ro.* value can be kept */
+    if (stamp->area == NULL && !(found && isReadOnly(key)))
+        return;
+
+    strcpy(e->key, key);
+    if (found)
+        strcpy(e->value, value);
+    e->found = found;
+    e->stamp = *stamp;
+    e->valid = 1;
+}
+
 /*
  * Perform one-time initialization.
  */
 static void init(void)
 {
-    assert(gPropFd == -1);
+    gArea = mapArea(SYSTEM_PROPERTY_AREA_NAME);
+    pthread_key_create(&gConnKey, closeConnection);
+}
 
-    gPropFd = connectToServer(SYSTEM_PROPERTY_PIPE_NAME);
-    if (gPropFd < 0) {
-        //LOGW("not connected to system property server\n");
-    } else {
-        //LOGV("Connected to system property server\n");
+/*
+ * Read a GetV2 reply into value (size bytes), truncating if need be.
+ * Returns 1 if the property is set, 0 if not, -1 on error.
+ */
+static int readValueV2(int fd, char *value, size_t size)
+{
+    char discard[256];
+    unsigned char hdr[3];
+    size_t vlen, n;
+
+    if (readFully(fd, hdr, sizeof(hdr)) < 0 || hdr[0] > 1)
+        return -1;
+    vlen = hdr[1] | (hdr[2] << 8);
+
+    n = vlen < size ? vlen : size - 1;
+    if (readFully(fd, value, n) < 0)
+        return -1;
+    value[n] = '\0';
+    for (vlen -= n; vlen > 0; vlen -= n) {
+        n = vlen < sizeof(discard) ? vlen : sizeof(discard);
+        if (readFully(fd, discard, n) < 0)
+            return -1;
     }
+    return hdr[0];
 }
 
-int property_get(const char *key, char *value, const char *default_value)
+/*
+ * Ask the server for key.  Returns 1 if it is set, 0 if not, -1 on error.
+ */
+static int serverGet(const char *key, char *value, size_t size)
 {
-    char sendBuf[1+PROPERTY_KEY_MAX];
+    char sendBuf[2+PROPERTY_KEY_MAX];
     char recvBuf[1+PROPERTY_VALUE_MAX];
-    int len = -1;
+    int attempt, fd, found;
+    size_t klen = strlen(key);
 
-    //LOGV("PROPERTY GET [%s]\n", key);
+    for (attempt = 0; attempt < 2; attempt++) {
+        fd = getConnection();
+        if (fd < 0)
+            return -1;
 
-    pthread_once(&gInitOnce, init);
-    if (gPropFd < 0) {
-        /* this mimics the behavior of the device implementation */
-        if (default_value != NULL) {
-            strcpy(value, default_value);
-            len = strlen(value);
+        if (tPropVersion >= 2) {
+            sendBuf[0] = (char) kSystemPropertyGetV2;
+            sendBuf[1] = (char) klen;
+            memcpy(sendBuf+2, key, klen);
+            if (writeFully(fd, sendBuf, 2 + klen) == 0 &&
+                    (found = readValueV2(fd, value, size)) >= 0)
+                return found;
+            dropConnection();
+            continue;
+        }
+
+        memset(sendBuf, 0xdd, sizeof(sendBuf));    // placate valgrind
+
+        sendBuf[0] = (char) kSystemPropertyGet;
+        strcpy(sendBuf+1, key);
+
+        if (writeFully(fd, sendBuf, 1 + PROPERTY_KEY_MAX) < 0 ||
+                readFully(fd, recvBuf, sizeof(recvBuf)) < 0) {
+            dropConnection();
+            continue;
+        }
+
+        /* first byte is 0 if value not defined, 1 if found */
+        if (recvBuf[0] == 1) {
+            recvBuf[PROPERTY_VALUE_MAX] = '\0';
+            snprintf(value, size, "%s", recvBuf+1);
+        } else if (recvBuf[0] != 0) {
+            printf("Got strange response to property_get request (%d)\n",
+                recvBuf[0]);
+            assert(0);
+            return -1;
         }
-        return len;
+        return recvBuf[0];
     }
+    return -1;
+}
 
-    if (strlen(key) >= PROPERTY_KEY_MAX) return -1;
+int property_get(const char *key, char *value, const char *default_value)
+{
+    char valueBuf[PROPERTY_VALUE_MAX];
+    const prop_area *area;
+    CacheStamp stamp;
+    int found = -1;
 
-    memset(sendBuf, 0xdd, sizeof(sendBuf));    // placate valgrind
+    //LOGV("PROPERTY GET [%s]\n", key);
 
-    sendBuf[0] = (char) kSystemPropertyGet;
-    strcpy(sendBuf+1, key);
+    pthread_once(&gInitOnce, init);
 
-    pthread_mutex_lock(&gPropertyFdLock);
-    if (write(gPropFd, sendBuf, sizeof(sendBuf)) != sizeof(sendBuf)) {
-        pthread_mutex_unlock(&gPropertyFdLock);
+    if (strlen(key) >= PROPERTY_KEY_MAX) {
+        if (getConnection() < 0 && default_value != NULL) {
+            /* this mimics the behavior of the device implementation */
+            strcpy(value, default_value);
+            return strlen(value);
+        }
         return -1;
     }
-    if (read(gPropFd, recvBuf, sizeof(recvBuf)) != sizeof(recvBuf)) {
-        pthread_mutex_unlock(&gPropertyFdLock);
-        return -1;
+
+    if (gCacheEnabled) {
+        found = cacheGet(key, valueBuf);
+        if (found >= 0)
+            goto done;
     }
-    pthread_mutex_unlock(&gPropertyFdLock);
 
-    /* first byte is 0 if value not defined, 1 if found */
-    if (recvBuf[0] == 0) {
-        if (default_value != NULL) {
+    stamp.area = NULL;
+    area = getArea();
+    if (area != NULL)
+        found = areaGet(area, key, valueBuf, &stamp);
+
+    if (found < 0) {
+        if (getConnection() < 0) {
+            /* this mimics the behavior of the device implementation */
+            if (default_value == NULL)
+                return -1;
             strcpy(value, default_value);
-            len = strlen(value);
-        } else {
-            /*
-             * If the value isn't defined, hand back an empty string and
-             * a zero length, rather than a failure.  This seems wrong,
-             * since you can't tell the difference between "undefined" and
-             * "defined but empty", but it's what the device does.
-             */
-            value[0] = '\0';
-            len = 0;
-        }
-    } else if (recvBuf[0] == 1) {
-        strcpy(value, recvBuf+1);
-        len = strlen(value);
+            return strlen(value);
+        }
+        found = serverGet(key, valueBuf, sizeof(valueBuf));
+        if (found < 0)
+            return -1;
+    }
+
+    if (gCacheEnabled)
+        cachePut(key, found, valueBuf, &stamp);
+
+done:
+    if (found) {
+        strcpy(value, valueBuf);
+    } else if (default_value != NULL) {
+        strcpy(value, default_value);
     } else {
-        printf("Got strange response to property_get request (%d)\n",
-            recvBuf[0]);
-        assert(0);
-        return -1;
+        /*
+         * If the value isn't defined, hand back an empty string and
+         * a zero length, rather than a failure.  This seems wrong,
+         * since you can't tell the difference between "undefined" and
+         * "defined but empty", but it's what the device does.
+         */
+        value[0] = '\0';
     }
     //LOGV("PROP [found=%d def='%s'] (%d) [%s]: [%s]\n",
-    //    recvBuf[0], default_value, len, key, value);
+    //    found, default_value, len, key, value);
+
+    return strlen(value);
+}
 
-    return len;
+
+int property_get_long(const char *key, char *value, size_t size,
+                      const char *default_value)
+{
+    char valueBuf[PROPERTY_VALUE_MAX];
+    const prop_area *area;
+    CacheStamp stamp;
+    int found = -1, served;
+
+    pthread_once(&gInitOnce, init);
+
+    if (size == 0 || strlen(key) >= PROPERTY_KEY_MAX)
+        return -1;
+
+    /* the area holds all but the long values */
+    area = getArea();
+    if (area != NULL)
+        found = areaGet(area, key, valueBuf, &stamp);
+    if (found == 1 && !(stamp.flags & PI_LONG)) {
+        snprintf(value, size, "%s", valueBuf);
+        return strlen(value);
+    }
+
+    if (found != 0 && getConnection() >= 0 &&
+            (served = serverGet(key, value, size)) >= 0) {
+        if (served)
+            return strlen(value);
+        found = 0;
+    }
+    if (found == 1) {
+        /* propd is unreachable; the truncated copy is the best we have */
+        snprintf(value, size, "%s", valueBuf);
+        return strlen(value);
+    }
+    if (found < 0 && default_value == NULL)
+        return -1;
+
+    snprintf(value, size, "%s", default_value ? default_value : "");
+    return strlen(value);
 }
 
+/*
+ * Encode a set in the frame the given protocol version uses.  Returns the
+ * frame length, or -1 if the value is too long for that version.
+ */
+static int encodeSet(char *buf, int version, const char *key, const char *value)
+{
+    size_t klen = strlen(key), vlen = strlen(value);
+
+    if (version >= 2) {
+        buf[0] = (char) kSystemPropertySetV2;
+        buf[1] = (char) klen;
+        buf[2] = (char) (vlen & 0xff);
+        buf[3] = (char) (vlen >> 8);
+        memcpy(buf+4, key, klen);
+        memcpy(buf+4+klen, value, vlen);
+        return 4 + klen + vlen;
+    }
+
+    if (vlen >= PROPERTY_VALUE_MAX) return -1;
+
+    memset(buf, 0xdd, 1 + PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX);    // placate valgrind
+
+    buf[0] = (char) kSystemPropertySet;
+    strcpy(buf+1, key);
+    strcpy(buf+1+PROPERTY_KEY_MAX, value);
+    return 1 + PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX;
+}
 
 int property_set(const char *key, const char *value)
 {
-    char sendBuf[1+PROPERTY_KEY_MAX+PROPERTY_VALUE_MAX];
+    char sendBuf[4+PROPERTY_KEY_MAX+PROPERTY_LONG_VALUE_MAX];
     char recvBuf[1];
-    int result = -1;
+    int len;
 
     //LOGV("PROPERTY SET [%s]: [%s]\n", key, value);
 
     pthread_once(&gInitOnce, init);
-    if (gPropFd < 0)
-        return -1;
 
     if (strlen(key) >= PROPERTY_KEY_MAX) return -1;
-    if (strlen(value) >= PROPERTY_VALUE_MAX) return -1;
-
-    memset(sendBuf, 0xdd, sizeof(sendBuf));    // placate valgrind
+    if (strlen(value) >= PROPERTY_LONG_VALUE_MAX) return -1;
 
-    sendBuf[0] = (char) kSystemPropertySet;
-    strcpy(sendBuf+1, key);
-    strcpy(sendBuf+1+PROPERTY_KEY_MAX, value);
+    if (getConnection() < 0)
+        return -1;
 
-    pthread_mutex_lock(&gPropertyFdLock);
-    if (write(gPropFd, sendBuf, sizeof(sendBuf)) != sizeof(sendBuf)) {
-        pthread_mutex_unlock(&gPropertyFdLock);
+    len = encodeSet(sendBuf, tPropVersion, key, value);
+    if (len < 0)
         return -1;
-    }
-    if (read(gPropFd, recvBuf, sizeof(recvBuf)) != sizeof(recvBuf)) {
-        pthread_mutex_unlock(&gPropertyFdLock);
+
+    if (transact(sendBuf, len, recvBuf, sizeof(recvBuf)) < 0)
         return -1;
-    }
-    pthread_mutex_unlock(&gPropertyFdLock);
 
     if (recvBuf[0] != 1)
         return -1;
     return 0;
 }
+
+static void setDefault(char *value, const char *default_value)
+{
+    if (default_value != NULL)
+        strcpy(value, default_value);
+    else
+        value[0] = '\0';
+}
+
 /*
-int property_list(void (*propfn)(const char *key, const char *value, void *cookie), 
-                  void *cookie)
+ * Fetch up to PROPERTY_BATCH_MAX keys from the server in one round trip.
+ */
+static int getManyFromServer(int count, const char **keys, char **values,
+                             const char *default_value)
 {
-    //LOGV("PROPERTY LIST\n");
-    pthread_once(&gInitOnce, init);
-    if (gPropFd < 0)
+    char sendBuf[2 + PROPERTY_BATCH_MAX * PROPERTY_KEY_MAX];
+    char recvBuf[PROPERTY_BATCH_MAX * (1 + PROPERTY_VALUE_MAX)];
+    char *reply;
+    int i;
+
+    memset(sendBuf, 0xdd, sizeof(sendBuf));    // placate valgrind
+
+    sendBuf[0] = (char) kSystemPropertyGetMany;
+    sendBuf[1] = (char) count;
+    for (i = 0; i < count; i++)
+        strcpy(sendBuf + 2 + i * PROPERTY_KEY_MAX, keys[i]);
+
+    if (transact(sendBuf, 2 + count * PROPERTY_KEY_MAX,
+                 recvBuf, count * (1 + PROPERTY_VALUE_MAX)) < 0)
         return -1;
 
+    for (i = 0; i < count; i++) {
+        reply = recvBuf + i * (1 + PROPERTY_VALUE_MAX);
+        if (reply[0] == 1) {
+            reply[PROPERTY_VALUE_MAX] = '\0';
+            strcpy(values[i], reply + 1);
+        } else {
+            setDefault(values[i], default_value);
+        }
+    }
     return 0;
 }
-*/
-int property_list(char *path)
+
+int property_get_many(int count, const char **keys, char **values,
+                      const char *default_value)
 {
-    char sendBuf[1];
-    char recvBuf[1];
-	
+    const char *missKeys[PROPERTY_BATCH_MAX];
+    char *missValues[PROPERTY_BATCH_MAX];
+    const prop_area *area;
+    CacheStamp stamp;
+    uint32_t commit = 0;
+    unsigned tries = 0;
+    int i, misses;
 
-    //LOGV("PROPERTY LIST\n");
     pthread_once(&gInitOnce, init);
-    if (gPropFd < 0)
-        return -1;
 
-    memset(sendBuf, 0xdd, sizeof(sendBuf));    // placate valgrind
+    for (i = 0; i < count; i++) {
+        if (strlen(keys[i]) >= PROPERTY_KEY_MAX)
+            return -1;
+    }
 
-    sendBuf[0] = (char) kSystemPropertyList;
+    /*
+     * Answer what we can from the shared area, batch the rest.  The area
+     * answers are taken as of one point between commits: if a commit
+     * lands while we are reading, go round again.
+     */
+    area = getArea();
+    for (;;) {
+        /* a commit that never completes sends everything to propd */
+        while (area != NULL &&
+               ((commit = __atomic_load_n(&area->commit, __ATOMIC_ACQUIRE)) & 1)) {
+            if (tries == AREA_RETRY_MAX)
+                area = NULL;
+            else
+                areaPause(tries++);
+        }
 
-    pthread_mutex_lock(&gPropertyFdLock);
-    if (write(gPropFd, sendBuf, sizeof(sendBuf)) != sizeof(sendBuf)) {
-        pthread_mutex_unlock(&gPropertyFdLock);
-        return -1;
+        for (i = 0, misses = 0; i < count; i++) {
+            if (area != NULL) {
+                switch (areaGet(area, keys[i], values[i], &stamp)) {
+                case 1:
+                    continue;
+                case 0:
+                    setDefault(values[i], default_value);
+                    continue;
+                }
+            }
+
+            if (getConnection() < 0) {
+                setDefault(values[i], default_value);
+                continue;
+            }
+
+            missKeys[misses] = keys[i];
+            missValues[misses] = values[i];
+            if (++misses == PROPERTY_BATCH_MAX) {
+                if (getManyFromServer(misses, missKeys, missValues, default_value) < 0)
+                    return -1;
+                misses = 0;
+            }
+        }
+
+        if (misses > 0 &&
+                getManyFromServer(misses, missKeys, missValues, default_value) < 0)
+            return -1;
+
+        if (area == NULL || __atomic_load_n(&area->commit, __ATOMIC_ACQUIRE) == commit)
+            return 0;
+        if (tries == AREA_RETRY_MAX)
+            area = NULL;
+        else
+            areaPause(tries++);
     }
-    if (read(gPropFd, recvBuf, sizeof(recvBuf)) != sizeof(recvBuf)) {
-        pthread_mutex_unlock(&gPropertyFdLock);
+}
+
+/*
+ * Commit frames are variable length like v2 ones: per entry, key length,
+ * 16-bit little-endian value length, key and value.
+ */
+int property_commit(int count, const char **keys, const char **values)
+{
+    unsigned char sendBuf[PROPERTY_COMMIT_MAX];
+    unsigned char result;
+    size_t used = 2, klen, vlen;
+    int i;
+
+    pthread_once(&gInitOnce, init);
+
+    if (count <= 0 || count > PROPERTY_BATCH_MAX)
         return -1;
-    }
-    pthread_mutex_unlock(&gPropertyFdLock);
 
-	sprintf(path, "%s", SYSTEM_PROPERTY_LIST_NAME);
+    for (i = 0; i < count; i++) {
+        klen = strlen(keys[i]);
+        vlen = strlen(values[i]);
+        if (klen == 0 || klen >= PROPERTY_KEY_MAX || vlen >= PROPERTY_LONG_VALUE_MAX ||
+                used + 3 + klen + vlen > sizeof(sendBuf))
+            return -1;
+        sendBuf[used] = klen;
+        sendBuf[used + 1] = vlen & 0xff;
+        sendBuf[used + 2] = vlen >> 8;
+        memcpy(sendBuf + used + 3, keys[i], klen);
+        memcpy(sendBuf + used + 3 + klen, values[i], vlen);
+        used += 3 + klen + vlen;
+    }
+    sendBuf[0] = kSystemPropertyCommit;
+    sendBuf[1] = count;
 
-    if (recvBuf[0] != 1)
+    if (transact(sendBuf, used, &result, 1) < 0 || result != 1)
         return -1;
     return 0;
 }
+
+int property_set_many(int count, const char **keys, const char **values)
+{
+    char sendBuf[2 + PROPERTY_BATCH_MAX * (PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX)];
+    char recvBuf[PROPERTY_BATCH_MAX];
+    char *entry;
+    int i, n, done, result = 0;
+
+    pthread_once(&gInitOnce, init);
+
+    for (i = 0; i < count; i++) {
+        if (strlen(keys[i]) >= PROPERTY_KEY_MAX) return -1;
+        if (strlen(values[i]) >= PROPERTY_VALUE_MAX) return -1;
+    }
+
+    for (done = 0; done < count && result == 0; done += n) {
+        n = count - done;
+        if (n > PROPERTY_BATCH_MAX)
+            n = PROPERTY_BATCH_MAX;
+
+        memset(sendBuf, 0xdd, sizeof(sendBuf));    // placate valgrind
+
+        sendBuf[0] = (char) kSystemPropertySetMany;
+        sendBuf[1] = (char) n;
+        for (i = 0; i < n; i++) {
+            entry = sendBuf + 2 + i * (PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX);
+            strcpy(entry, keys[done + i]);
+            strcpy(entry + PROPERTY_KEY_MAX, values[done + i]);
+        }
+
+        if (transact(sendBuf, 2 + n * (PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX),
+                     recvBuf, n) < 0)
+            result = -1;
+
+        for (i = 0; i < n && result == 0; i++) {
+            if (recvBuf[i] != 1)
+                result = -1;
+        }
+    }
+    return result;
+}
+
+/*
+ * Fire-and-forget sets through a ring shared with propd; see prop_ring.h.
+ * The ring is per process and set up on first use on a connection of its
+ * own, which then also carries any set that can't go through the ring (a
+ * full ring, or a value too long for a slot).  propd drains the ring
+ * before it reads that connection, so such a set still lands after
+ * everything published before it.  gRingLock serialises the producers.
+ *
+ * If propd can't take a ring (an older server, or no memfd sealing or fd
+ * passing here), that is remembered until a new propd is up, and until
+ * then property_publish goes straight to property_set.
+ */
+static pthread_mutex_t gRingLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t gRingOnce = PTHREAD_ONCE_INIT;
+static prop_ring *gRing;
+static const prop_area *gRingArea;  /* the area of the propd we handed it to */
+static int gRingFd = -1;
+static int gRingKick = -1;
+static int gRingVersion;
+static int gRingRefused;
+static const prop_area *gRingRefusedArea;  /* the area of the propd that did */
+
+static void ringDetach(void)
+{
+    if (gRing != NULL)
+        munmap(gRing, sizeof(prop_ring));
+    if (gRingFd >= 0)
+        close(gRingFd);
+    if (gRingKick >= 0)
+        close(gRingKick);
+    gRing = NULL;
+    gRingFd = gRingKick = -1;
+}
+
+/* a forked child must not produce into its parent's ring */
+static void ringForget(void)
+{
+    pthread_mutex_init(&gRingLock, NULL);
+    ringDetach();
+}
+
+static void ringInit(void)
+{
+    pthread_atfork(NULL, NULL, ringForget);
+}
+
+/* create a ring and hand it to propd; called with gRingLock held */
+static int ringAttach(void)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    unsigned char op = kSystemPropertyRing, result = 0;
+    int memfd;
+
+    memfd = memfd_create("prop-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0)
+        return -1;
+    if (ftruncate(memfd, sizeof(prop_ring)) < 0 ||
+            fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+        goto fail;
+    gRing = mmap(NULL, sizeof(prop_ring), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (gRing == MAP_FAILED) {
+        gRing = NULL;
+        goto fail;
+    }
+    gRing->magic = PR_MAGIC;
+    gRing->slots = PR_SLOTS;
+
+    gRingArea = getArea();
+    gRingKick = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    gRingFd = connectAndNegotiate(&gRingVersion);
+    if (gRingKick < 0 || gRingFd < 0)
+        goto fail;
+
+    iov.iov_base = &op;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control;
+    msg.msg_controllen = CMSG_SPACE(2 * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+    memcpy(CMSG_DATA(cmsg) + sizeof(int), &gRingKick, sizeof(int));
+
+    if (sendmsg(gRingFd, &msg, MSG_NOSIGNAL) != 1 ||
+            readFully(gRingFd, &result, 1) < 0 || result != 1)
+        goto fail;
+
+    close(memfd);
+    return 0;
+
+fail:
+    close(memfd);
+    ringDetach();
+    return -1;
+}
+
+/* a set on the ring's connection; called with gRingLock held */
+static int ringSetDirect(const char *key, const char *value)
+{
+    char sendBuf[4+PROPERTY_KEY_MAX+PROPERTY_LONG_VALUE_MAX];
+    unsigned char result;
+    int len;
+
+    len = encodeSet(sendBuf, gRingVersion, key, value);
+    if (len < 0)
+        return -1;
+    if (writeFully(gRingFd, sendBuf, len) < 0 || readFully(gRingFd, &result, 1) < 0) {
+        ringDetach();
+        return -1;
+    }
+    return result == 1 ? 0 : -1;
+}
+
+int property_publish(const char *key, const char *value)
+{
+    prop_ring_slot *slot;
+    uint32_t head, tail;
+    uint64_t one = 1;
+    size_t klen, vlen;
+    int result;
+
+    pthread_once(&gInitOnce, init);
+    pthread_once(&gRingOnce, ringInit);
+
+    klen = strlen(key);
+    vlen = strlen(value);
+    if (klen >= PROPERTY_KEY_MAX || vlen >= PROPERTY_LONG_VALUE_MAX)
+        return -1;
+
+    pthread_mutex_lock(&gRingLock);
+
+    /* a restarted propd knows nothing of our ring */
+    if (gRing != NULL && gRingArea != getArea())
+        ringDetach();
+    if (gRing == NULL &&
+            ((gRingRefused && gRingRefusedArea == getArea()) || ringAttach() < 0)) {
+        gRingRefused = 1;
+        gRingRefusedArea = getArea();
+        pthread_mutex_unlock(&gRingLock);
+        return property_set(key, value);
+    }
+
+    tail = gRing->tail;
+    head = __atomic_load_n(&gRing->head, __ATOMIC_ACQUIRE);
+    if (tail - head >= PR_SLOTS || vlen >= PROPERTY_VALUE_MAX) {
+        result = ringSetDirect(key, value);
+        pthread_mutex_unlock(&gRingLock);
+        return result;
+    }
+
+    slot = &gRing->slot[tail & (PR_SLOTS - 1)];
+    memcpy(slot->key, key, klen + 1);
+    memcpy(slot->value, value, vlen + 1);
+    __atomic_store_n(&gRing->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_exchange_n(&gRing->waiting, 0, __ATOMIC_SEQ_CST) ||
+            tail + 1 - head == PR_SLOTS / 2)
+        write(gRingKick, &one, sizeof(one));
+
+    pthread_mutex_unlock(&gRingLock);
+    return 0;
+}
+
+/*
+ * Pipelined requests.
+ *
+ * A property_async handle owns a non-blocking connection of its own.
+ * Requests are encoded into an output buffer and only sent when the
+ * handle is dispatched, so any number of them leave in as few writes as
+ * the socket allows.  The server answers in order, so replies are matched
+ * against a FIFO of outstanding requests.
+ */
+#define ASYNC_READ_CHUNK    (2 * (3 + PROPERTY_LONG_VALUE_MAX))  /* fits any reply */
+
+typedef struct AsyncRequest {
+    unsigned char op;                   /* kSystemPropertyGet or Set */
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    char *longValue;                    /* set values that don't fit */
+    property_async_fn fn;
+    void *cookie;
+} AsyncRequest;
+
+struct property_async {
+    int fd;
+    int version;                        /* protocol spoken on fd */
+
+    unsigned char *out;                 /* encoded, not yet sent */
+    size_t outHead, outLen, outSize;
+
+    unsigned char in[ASYNC_READ_CHUNK]; /* replies not yet matched */
+    size_t inLen;
+
+    AsyncRequest *reqs;                 /* sent or queued, unanswered */
+    unsigned reqHead, reqCount, reqSize;
+
+    int closing;                        /* no new requests are taken */
+};
+
+property_async *property_async_open(void)
+{
+    property_async *pa;
+
+    pthread_once(&gInitOnce, init);
+
+    pa = calloc(1, sizeof(*pa));
+    if (pa == NULL)
+        return NULL;
+    pa->fd = -1;
+    return pa;
+}
+
+static int asyncConnect(property_async *pa)
+{
+    int flags;
+
+    if (pa->fd >= 0)
+        return 0;
+    pa->fd = connectAndNegotiate(&pa->version);
+    if (pa->fd < 0)
+        return -1;
+    flags = fcntl(pa->fd, F_GETFL);
+    fcntl(pa->fd, F_SETFL, flags | O_NONBLOCK);
+    fcntl(pa->fd, F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+/*
+ * The connection broke: every outstanding request fails, and the next
+ * request reconnects.
+ */
+static void asyncFail(property_async *pa)
+{
+    AsyncRequest *reqs = pa->reqs;
+    unsigned i, head = pa->reqHead, count = pa->reqCount;
+
+    if (pa->fd >= 0) {
+        close(pa->fd);
+        pa->fd = -1;
+    }
+    pa->outHead = pa->outLen = 0;
+    pa->inLen = 0;
+
+    /* detach first: the callbacks may queue new requests */
+    pa->reqs = NULL;
+    pa->reqHead = pa->reqCount = pa->reqSize = 0;
+
+    for (i = head; i < head + count; i++) {
+        if (reqs[i].fn != NULL)
+            reqs[i].fn(reqs[i].key,
+                       reqs[i].op == kSystemPropertyGet ? "" :
+                       reqs[i].longValue ? reqs[i].longValue : reqs[i].value,
+                       -1, reqs[i].cookie);
+        free(reqs[i].longValue);
+    }
+    free(reqs);
+}
+
+static int asyncQueue(property_async *pa, unsigned char op, const char *key,
+                      const char *value, property_async_fn fn, void *cookie)
+{
+    size_t klen, vlen, len, size;
+    unsigned char *out;
+    char *longValue = NULL;
+    AsyncRequest *reqs, *req;
+
+    klen = strlen(key);
+    vlen = value != NULL ? strlen(value) : 0;
+    if (klen >= PROPERTY_KEY_MAX) return -1;
+    if (vlen >= PROPERTY_LONG_VALUE_MAX) return -1;
+    if (pa->closing || asyncConnect(pa) < 0)
+        return -1;
+
+    if (pa->version >= 2)
+        len = op == kSystemPropertySet ? 4 + klen + vlen : 2 + klen;
+    else if (vlen >= PROPERTY_VALUE_MAX)
+        return -1;
+    else
+        len = 1 + PROPERTY_KEY_MAX + (op == kSystemPropertySet ? PROPERTY_VALUE_MAX : 0);
+    if (pa->outLen + len > pa->outSize) {
+        if (pa->outHead > 0) {
+            memmove(pa->out, pa->out + pa->outHead, pa->outLen - pa->outHead);
+            pa->outLen -= pa->outHead;
+            pa->outHead = 0;
+        }
+        for (size = pa->outSize ? pa->outSize : 4096; pa->outLen + len > size; )
+            size *= 2;
+        if (size != pa->outSize) {
+            out = realloc(pa->out, size);
+            if (out == NULL)
+                return -1;
+            pa->out = out;
+            pa->outSize = size;
+        }
+    }
+
+    if (pa->reqHead + pa->reqCount == pa->reqSize) {
+        if (pa->reqHead > 0) {
+            memmove(pa->reqs, pa->reqs + pa->reqHead,
+                    pa->reqCount * sizeof(AsyncRequest));
+            pa->reqHead = 0;
+        } else {
+            size = pa->reqSize ? pa->reqSize * 2 : 32;
+            reqs = realloc(pa->reqs, size * sizeof(AsyncRequest));
+            if (reqs == NULL)
+                return -1;
+            pa->reqs = reqs;
+            pa->reqSize = size;
+        }
+    }
+
+    if (vlen >= PROPERTY_VALUE_MAX) {
+        longValue = strdup(value);
+        if (longValue == NULL)
+            return -1;
+    }
+
+    out = pa->out + pa->outLen;
+    if (pa->version >= 2 && op == kSystemPropertySet) {
+        out[0] = kSystemPropertySetV2;
+        out[1] = klen;
+        out[2] = vlen & 0xff;
+        out[3] = vlen >> 8;
+        memcpy(out + 4, key, klen);
+        memcpy(out + 4 + klen, value, vlen);
+    } else if (pa->version >= 2) {
+        out[0] = kSystemPropertyGetV2;
+        out[1] = klen;
+        memcpy(out + 2, key, klen);
+    } else {
+        memset(out, 0, len);
+        out[0] = op;
+        strcpy((char *) out + 1, key);
+        if (op == kSystemPropertySet)
+            strcpy((char *) out + 1 + PROPERTY_KEY_MAX, value);
+    }
+    pa->outLen += len;
+
+    req = &pa->reqs[pa->reqHead + pa->reqCount++];
+    req->op = op;
+    strcpy(req->key, key);
+    snprintf(req->value, sizeof(req->value), "%s", value != NULL ? value : "");
+    req->longValue = longValue;
+    req->fn = fn;
+    req->cookie = cookie;
+    return 0;
+}
+
+int property_async_get(property_async *pa, const char *key,
+                       property_async_fn fn, void *cookie)
+{
+    return asyncQueue(pa, kSystemPropertyGet, key, NULL, fn, cookie);
+}
+
+int property_async_set(property_async *pa, const char *key, const char *value,
+                       property_async_fn fn, void *cookie)
+{
+    return asyncQueue(pa, kSystemPropertySet, key, value, fn, cookie);
+}
+
+int property_async_fd(const property_async *pa)
+{
+    return pa->fd;
+}
+
+int property_async_events(const property_async *pa)
+{
+    int events = 0;
+
+    if (pa->reqCount > 0)
+        events |= POLLIN;
+    if (pa->outHead < pa->outLen)
+        events |= POLLOUT;
+    return events;
+}
+
+/*
+ * Match as many buffered replies as are complete against the oldest
+ * outstanding requests.  Callbacks may queue further requests.
+ *
+ * Returns -1 if the server sent something we can't parse.
+ */
+static int asyncComplete(property_async *pa)
+{
+    char value[PROPERTY_LONG_VALUE_MAX];
+    const unsigned char *reply;
+    AsyncRequest req;
+    size_t used = 0, len, vlen;
+    int result;
+
+    while (pa->reqCount > 0) {
+        req = pa->reqs[pa->reqHead];
+        reply = pa->in + used;
+        if (req.op == kSystemPropertySet) {
+            len = 1;
+            vlen = 0;
+        } else if (pa->version >= 2) {
+            if (pa->inLen - used < 3)
+                break;
+            vlen = reply[1] | (reply[2] << 8);
+            if (vlen >= PROPERTY_LONG_VALUE_MAX)
+                return -1;
+            len = 3 + vlen;
+            reply += 2;
+        } else {
+            len = 1 + PROPERTY_VALUE_MAX;
+            vlen = PROPERTY_VALUE_MAX - 1;
+        }
+        if (pa->inLen - used < len)
+            break;
+
+        result = pa->in[used] == 1 ? 0 : -1;
+        if (req.op == kSystemPropertyGet) {
+            memcpy(value, reply + 1, vlen);
+            value[vlen] = '\0';
+            if (result < 0)
+                value[0] = '\0';
+        }
+        used += len;
+
+        pa->reqHead++;
+        if (--pa->reqCount == 0)
+            pa->reqHead = 0;
+        if (req.fn != NULL)
+            req.fn(req.key,
+                   req.op == kSystemPropertyGet ? value :
+                   req.longValue ? req.longValue : req.value,
+                   result, req.cookie);
+        free(req.longValue);
+    }
+
+    memmove(pa->in, pa->in + used, pa->inLen - used);
+    pa->inLen -= used;
+    return 0;
+}
+
+int property_async_dispatch(property_async *pa)
+{
+    ssize_t actual;
+
+    if (pa->fd < 0)
+        return pa->reqCount > 0 ? -1 : 0;
+
+    /* send what the socket will take, then drain replies, until stuck */
+    for (;;) {
+        while (pa->outHead < pa->outLen) {
+            actual = send(pa->fd, pa->out + pa->outHead, pa->outLen - pa->outHead,
+                          MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (actual < 0 && errno == EINTR)
+                continue;
+            if (actual < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (actual <= 0)
+                goto fail;
+            pa->outHead += actual;
+        }
+        if (pa->outHead == pa->outLen)
+            pa->outHead = pa->outLen = 0;
+
+        if (pa->reqCount == 0)
+            return 0;
+
+        actual = recv(pa->fd, pa->in + pa->inLen, sizeof(pa->in) - pa->inLen,
+                      MSG_DONTWAIT);
+        if (actual < 0 && errno == EINTR)
+            continue;
+        if (actual < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return pa->reqCount;
+        if (actual <= 0)
+            goto fail;
+        pa->inLen += actual;
+        if (asyncComplete(pa) < 0)
+            goto fail;
+    }
+
+fail:
+    asyncFail(pa);
+    return -1;
+}
+
+int property_async_wait(property_async *pa, int timeout_ms)
+{
+    struct pollfd pfd;
+    struct timespec deadline, now;
+    int pending, wait_ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while ((pending = property_async_dispatch(pa)) > 0) {
+        wait_ms = -1;
+        if (timeout_ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            wait_ms = (deadline.tv_sec - now.tv_sec) * 1000 +
+                      (deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if (wait_ms <= 0)
+                return -1;
+        }
+        pfd.fd = pa->fd;
+        pfd.events = property_async_events(pa);
+        pfd.revents = 0;
+        if (poll(&pfd, 1, wait_ms) < 0 && errno != EINTR)
+            return -1;
+    }
+    return pending;
+}
+
+/* outstanding requests fail as they would on a broken connection */
+void property_async_close(property_async *pa)
+{
+    if (pa == NULL)
+        return;
+    pa->closing = 1;
+    asyncFail(pa);
+    free(pa->out);
+    free(pa);
+}
+
+/*
+ * Property watches.
+ *
+ * A connection that has sent kSystemPropertyWatch receives a notify frame
+ * (opcode, key, value) each time a watched key changes, interleaved with
+ * the two-byte acks of further watch requests.
+ */
+#define WATCH_FRAME_LEN (1 + PROPERTY_KEY_MAX + PROPERTY_VALUE_MAX)
+
+static int sendWatch(int fd, const char *key)
+{
+    char sendBuf[1 + PROPERTY_KEY_MAX];
+
+    memset(sendBuf, 0xdd, sizeof(sendBuf));    // placate valgrind
+
+    sendBuf[0] = (char) kSystemPropertyWatch;
+    strcpy(sendBuf + 1, key);
+    return writeFully(fd, sendBuf, sizeof(sendBuf));
+}
+
+/*
+ * Read one frame from a watch connection into frame (WATCH_FRAME_LEN
+ * bytes).  Returns the opcode, or -1 on error.
+ */
+static int readWatchFrame(int fd, char *frame)
+{
+    if (readFully(fd, frame, 1) < 0)
+        return -1;
+
+    switch (frame[0]) {
+    case kSystemPropertyWatch:
+        return readFully(fd, frame + 1, 1) < 0 ? -1 : kSystemPropertyWatch;
+    case kSystemPropertyNotify:
+        if (readFully(fd, frame + 1, WATCH_FRAME_LEN - 1) < 0)
+            return -1;
+        frame[PROPERTY_KEY_MAX] = '\0';
+        frame[WATCH_FRAME_LEN - 1] = '\0';
+        return kSystemPropertyNotify;
+    default:
+        return -1;
+    }
+}
+
+static int waitMatches(const char *value, const char *expected)
+{
+    return expected != NULL && strcmp(value, expected) == 0;
+}
+
+int property_wait(const char *key, const char *expected, int timeout_ms)
+{
+    char frame[WATCH_FRAME_LEN];
+    char value[PROPERTY_VALUE_MAX];
+    struct timespec now, deadline;
+    struct pollfd pfd;
+    int fd, wait_ms, result = -1;
+
+    if (strlen(key) >= PROPERTY_KEY_MAX)
+        return -1;
+
+    fd = connectToServer(SYSTEM_PROPERTY_PIPE_NAME);
+    if (fd < 0)
+        return -1;
+
+    if (sendWatch(fd, key) < 0 ||
+            readWatchFrame(fd, frame) != kSystemPropertyWatch || frame[1] != 1)
+        goto done;
+
+    /* the watch is in place, so a change after this check can't be missed */
+    property_get(key, value, "");
+    if (waitMatches(value, expected)) {
+        result = 0;
+        goto done;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    for (;;) {
+        wait_ms = -1;
+        if (timeout_ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            wait_ms = (deadline.tv_sec - now.tv_sec) * 1000 +
+                      (deadline.tv_nsec - now.tv_nsec) / 1000000L;
+            if (wait_ms < 0)
+                break;
+        }
+        if (poll(&pfd, 1, wait_ms) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfd.revents == 0)
+            break;
+        if (readWatchFrame(fd, frame) != kSystemPropertyNotify)
+            break;
+        if (expected == NULL ||
+                waitMatches(frame + 1 + PROPERTY_KEY_MAX, expected)) {
+            result = 0;
+            break;
+        }
+    }
+
+done:
+    close(fd);
+    return result;
+}
+
+/*
+ * Callback watches share one connection, served by a background thread.
+ * Entries are only ever prepended, so the thread walks the list without
+ * holding gWatchLock and callbacks are free to add more watches.
+ */
+typedef struct WatchEntry {
+    struct WatchEntry *next;
+    char key[PROPERTY_KEY_MAX];
+    property_watch_fn fn;
+    void *cookie;
+} WatchEntry;
+
+static pthread_mutex_t gWatchLock = PTHREAD_MUTEX_INITIALIZER;
+static WatchEntry *volatile gWatches = NULL;
+static int gWatchFd = -1;
+static int gWatchRunning = 0;
+
+#define WATCH_BACKOFF_MIN_MS    10
+#define WATCH_BACKOFF_MAX_MS    1000
+
+/*
+ * Open a new watch connection and register every watched key on it, so
+ * watches survive the server going away.  Keys added while we were
+ * disconnected are picked up here too.  Retries with backoff until the
+ * server comes back; returns with gWatchFd set.
+ */
+static void watchReconnect(void)
+{
+    struct timespec delay;
+    WatchEntry *w, *prev;
+    int fd, backoff = WATCH_BACKOFF_MIN_MS;
+
+    for (;;) {
+        delay.tv_sec = backoff / 1000;
+        delay.tv_nsec = (backoff % 1000) * 1000000L;
+        nanosleep(&delay, NULL);
+        if (backoff < WATCH_BACKOFF_MAX_MS)
+            backoff = backoff * 2 < WATCH_BACKOFF_MAX_MS ?
+                      backoff * 2 : WATCH_BACKOFF_MAX_MS;
+
+        fd = connectToServer(SYSTEM_PROPERTY_PIPE_NAME);
+        if (fd < 0)
+            continue;
+
+        pthread_mutex_lock(&gWatchLock);
+        for (w = gWatches; w; w = w->next) {
+            for (prev = gWatches; prev != w; prev = prev->next) {
+                if (strcmp(prev->key, w->key) == 0)
+                    break;
+            }
+            if (prev == w && sendWatch(fd, w->key) < 0)
+                break;
+        }
+        if (w == NULL) {
+            gWatchFd = fd;
+            pthread_mutex_unlock(&gWatchLock);
+            return;
+        }
+        pthread_mutex_unlock(&gWatchLock);
+        close(fd);
+    }
+}
+
+static void *watchThread(void *arg)
+{
+    char frame[WATCH_FRAME_LEN];
+    WatchEntry *w;
+    int fd, op;
+
+    for (;;) {
+        pthread_mutex_lock(&gWatchLock);
+        fd = gWatchFd;
+        pthread_mutex_unlock(&gWatchLock);
+
+        while ((op = readWatchFrame(fd, frame)) >= 0) {
+            if (op != kSystemPropertyNotify)
+                continue;
+            for (w = __atomic_load_n(&gWatches, __ATOMIC_ACQUIRE); w; w = w->next) {
+                if (strcmp(w->key, frame + 1) == 0)
+                    w->fn(w->key, frame + 1 + PROPERTY_KEY_MAX, w->cookie);
+            }
+        }
+
+        //LOGW("property watch connection lost\n");
+        pthread_mutex_lock(&gWatchLock);
+        close(gWatchFd);
+        gWatchFd = -1;
+        pthread_mutex_unlock(&gWatchLock);
+
+        watchReconnect();
+    }
+
+    return NULL;
+}
+
+int property_watch(const char *key, property_watch_fn fn, void *cookie)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    WatchEntry *w, *entry;
+    int known = 0, result = 0;
+
+    if (strlen(key) >= PROPERTY_KEY_MAX)
+        return -1;
+
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL)
+        return -1;
+    strcpy(entry->key, key);
+    entry->fn = fn;
+    entry->cookie = cookie;
+
+    pthread_mutex_lock(&gWatchLock);
+    if (!gWatchRunning) {
+        gWatchFd = connectToServer(SYSTEM_PROPERTY_PIPE_NAME);
+        if (gWatchFd < 0) {
+            result = -1;
+        } else {
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            if (pthread_create(&thread, &attr, watchThread, NULL) != 0) {
+                close(gWatchFd);
+                gWatchFd = -1;
+                result = -1;
+            } else {
+                gWatchRunning = 1;
+            }
+            pthread_attr_destroy(&attr);
+        }
+    }
+
+    /*
+     * One server-side watch per key; the thread fans out to callbacks.
+     * While the thread is reconnecting there's no connection to send on,
+     * and a failed send means it's about to notice the connection is
+     * gone.  Either way the reconnect registers the new key.
+     */
+    if (result == 0 && gWatchFd >= 0) {
+        for (w = gWatches; w; w = w->next) {
+            if (strcmp(w->key, key) == 0)
+                known = 1;
+        }
+        if (!known)
+            sendWatch(gWatchFd, key);
+    }
+
+    if (result == 0) {
+        entry->next = gWatches;
+        __atomic_store_n(&gWatches, entry, __ATOMIC_RELEASE);
+    } else {
+        free(entry);
+    }
+    pthread_mutex_unlock(&gWatchLock);
+    return result;
+}
+
+/*
+ * The listing is read into memory in full before any callback runs, so
+ * callbacks may make property calls of their own.
+ */
+int property_list_prefix(const char *prefix,
+                         void (*propfn)(const char *key, const char *value, void *cookie),
+                         void *cookie)
+{
+    char sendBuf[1+PROPERTY_KEY_MAX];
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+    unsigned char hdr[2];
+    unsigned char *records = NULL, *p, *tmp;
+    size_t used = 0, size = 0;
+    int fd, result = 0, retried = 0;
+
+    //LOGV("PROPERTY LIST\n");
+    pthread_once(&gInitOnce, init);
+
+    if (strlen(prefix) >= PROPERTY_KEY_MAX) return -1;
+
+    memset(sendBuf, 0xdd, sizeof(sendBuf));    // placate valgrind
+
+    sendBuf[0] = (char) kSystemPropertyList;
+    strcpy(sendBuf+1, prefix);
+
+retry:
+    if ((fd = getConnection()) < 0)
+        return -1;
+    if (writeFully(fd, sendBuf, sizeof(sendBuf)) < 0)
+        result = -1;
+    while (result == 0) {
+        if (readFully(fd, hdr, sizeof(hdr)) < 0) {
+            result = -1;
+            break;
+        }
+        if (hdr[0] == 0)
+            break;
+        if (hdr[0] >= PROPERTY_KEY_MAX || hdr[1] >= PROPERTY_VALUE_MAX) {
+            result = -1;
+            break;
+        }
+        if (used + 2 + hdr[0] + hdr[1] > size) {
+            size = size ? size * 2 : 4096;
+            tmp = realloc(records, size);
+            if (tmp == NULL) {
+                result = -1;
+                break;
+            }
+            records = tmp;
+        }
+        memcpy(records + used, hdr, sizeof(hdr));
+        if (readFully(fd, records + used + 2, hdr[0] + hdr[1]) < 0) {
+            result = -1;
+            break;
+        }
+        used += 2 + hdr[0] + hdr[1];
+    }
+    if (result < 0) {
+        /* the stream can't be resynchronised; drop the connection */
+        dropConnection();
+        if (used == 0 && !retried) {
+            retried = 1;
+            result = 0;
+            goto retry;
+        }
+    }
+
+    for (p = records; result == 0 && p < records + used; p += 2 + p[0] + p[1]) {
+        memcpy(key, p + 2, p[0]);
+        key[p[0]] = '\0';
+        memcpy(value, p + 2 + p[0], p[1]);
+        value[p[1]] = '\0';
+        propfn(key, value, cookie);
+    }
+
+    free(records);
+    return result;
+}
+
+/*
+ * History records as sent by propd: a 16-byte header, then key, old value
+ * and new value.  As with listings, everything is read before fn runs.
+ */
+#define HISTORY_HDR_LEN     16
+#define HISTORY_CREATED     0x01
+#define HISTORY_REMOVED     0x02
+
+static unsigned long long getLe(const unsigned char *p, int len)
+{
+    unsigned long long v = 0;
+
+    while (len-- > 0)
+        v = v << 8 | p[len];
+    return v;
+}
+
+int property_history(void (*fn)(const property_change *change, void *cookie),
+                     void *cookie)
+{
+    unsigned char op = kSystemPropertyHistory;
+    unsigned char *records = NULL, *p, *tmp;
+    unsigned char hdr[HISTORY_HDR_LEN];
+    char key[PROPERTY_KEY_MAX];
+    char oldValue[PROPERTY_VALUE_MAX];
+    char newValue[PROPERTY_VALUE_MAX];
+    property_change change;
+    size_t used = 0, size = 0, len;
+    int fd, result = 0;
+
+    pthread_once(&gInitOnce, init);
+
+    if ((fd = getConnection()) < 0)
+        return -1;
+    if (writeFully(fd, &op, 1) < 0)
+        result = -1;
+    while (result == 0) {
+        if (readFully(fd, hdr, sizeof(hdr)) < 0) {
+            result = -1;
+            break;
+        }
+        if (hdr[13] == 0)
+            break;
+        if (hdr[13] >= PROPERTY_KEY_MAX || hdr[14] >= PROPERTY_VALUE_MAX ||
+                hdr[15] >= PROPERTY_VALUE_MAX) {
+            result = -1;
+            break;
+        }
+        len = sizeof(hdr) + hdr[13] + hdr[14] + hdr[15];
+        if (used + len > size) {
+            size = size ? size * 2 : 8192;
+            tmp = realloc(records, size);
+            if (tmp == NULL) {
+                result = -1;
+                break;
+            }
+            records = tmp;
+        }
+        memcpy(records + used, hdr, sizeof(hdr));
+        if (readFully(fd, records + used + sizeof(hdr), len - sizeof(hdr)) < 0) {
+            result = -1;
+            break;
+        }
+        used += len;
+    }
+    if (result < 0)
+        dropConnection();
+
+    for (p = records; result == 0 && p < records + used;
+            p += HISTORY_HDR_LEN + p[13] + p[14] + p[15]) {
+        memcpy(key, p + HISTORY_HDR_LEN, p[13]);
+        key[p[13]] = '\0';
+        memcpy(oldValue, p + HISTORY_HDR_LEN + p[13], p[14]);
+        oldValue[p[14]] = '\0';
+        memcpy(newValue, p + HISTORY_HDR_LEN + p[13] + p[14], p[15]);
+        newValue[p[15]] = '\0';
+
+        change.time_ns = getLe(p, 8);
+        change.pid = (int) getLe(p + 8, 4);
+        change.key = key;
+        change.old_value = p[12] & HISTORY_CREATED ? NULL : oldValue;
+        change.new_value = p[12] & HISTORY_REMOVED ? NULL : newValue;
+        fn(&change, cookie);
+    }
+
+    free(records);
+    return result;
+}
+
+int property_list(void (*propfn)(const char *key, const char *value, void *cookie),
+                  void *cookie)
+{
+    return property_list_prefix("", propfn, cookie);
+}
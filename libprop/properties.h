@@ -1,28 +1,184 @@
 #ifndef __CUTILS_PROPERTIES_H
 #define __CUTILS_PROPERTIES_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define PROPERTY_KEY_MAX   32
 #define PROPERTY_VALUE_MAX  92
+#define PROPERTY_BATCH_MAX  64      /* keys per GetMany/SetMany frame */
+#define PROPERTY_LONG_VALUE_MAX 4096    /* see property_get_long */
+#define PROPERTY_COMMIT_MAX 8192    /* bytes in one commit frame */
+
+#define PROPERTY_PROTOCOL_VERSION   2
 
 int property_get(const char *key, char *value, const char *default_value);
 
+/*
+ * Values may be up to PROPERTY_LONG_VALUE_MAX - 1 bytes when propd speaks
+ * protocol v2.  property_get, listings and watches see only the first
+ * PROPERTY_VALUE_MAX - 1 bytes of a long value; property_get_long fetches
+ * as much as fits in size bytes.  Returns the length, or -1 on error.
+ */
+int property_get_long(const char *key, char *value, size_t size,
+                      const char *default_value);
+
+/*
+ * Opt in (or back out) of caching property_get results in each calling
+ * thread.  A cached value is checked against the serial propd publishes
+ * for its slot in the shared area or, for a key the area has no slot for,
+ * against the area's serial, which moves on every change.  Without the
+ * area nothing but ro.* values is cached; those are kept for good once
+ * seen.
+ */
+void property_cache_enable(int enable);
+
 int property_set(const char *key, const char *value);
 
-//int property_list(void (*propfn)(const char *key, const char *value, void *cookie), void *cookie);
-int property_list(char *path);
+/*
+ * Batched property_get/property_set: keys are sent to the server in frames
+ * of up to PROPERTY_BATCH_MAX, one round trip each.  Every values[i] for
+ * property_get_many must hold PROPERTY_VALUE_MAX bytes; keys that are not
+ * set get default_value (or "").  Both return 0 on success, -1 on error.
+ */
+int property_get_many(int count, const char **keys, char **values,
+                      const char *default_value);
+
+int property_set_many(int count, const char **keys, const char **values);
+
+/*
+ * Set up to PROPERTY_BATCH_MAX properties as one update: if any of them
+ * is rejected none is set, readers never see some of the new values
+ * without the others, and triggers and watchers run once, on the final
+ * values.  Encoded as 3 bytes per key plus the keys and values, the batch
+ * must fit in PROPERTY_COMMIT_MAX bytes.  Returns 0 on success, -1 on
+ * error.
+ */
+int property_commit(int count, const char **keys, const char **values);
+
+/*
+ * Fire-and-forget property_set for frequent updates, such as status
+ * published many times a second.  Updates go into a ring in memory
+ * shared with propd, which applies them in batches, usually within a few
+ * tens of milliseconds, and in order.  Most calls make no system call at
+ * all.  When the ring is full, or the value is too long for it, the call
+ * becomes an ordinary set.  Returns 0 once the update is queued or set,
+ * -1 on error; a rejected update is not reported.
+ */
+int property_publish(const char *key, const char *value);
+
+/*
+ * Pipelined requests on a connection of their own.  property_async_get
+ * and property_async_set only queue; property_async_dispatch sends what
+ * the socket will take without blocking, reads whatever replies have
+ * arrived and runs their callbacks in request order.  It returns the
+ * number of requests still outstanding, or -1 if the connection failed
+ * (outstanding callbacks then see result -1).
+ *
+ * To drive a handle from an event loop, poll property_async_fd for
+ * property_async_events and dispatch when it is ready; or block with
+ * property_async_wait, which returns 0 once everything has completed and
+ * -1 on timeout or error.
+ *
+ * Callbacks get result 0 on success, -1 if the key is not set, the set
+ * was rejected or the connection failed; value is "" for a failed get.
+ * They may queue more requests but must not dispatch or close the handle.
+ * A handle must only be used by one thread at a time.
+ *
+ * property_async_close drops the connection without waiting: every
+ * request still outstanding gets its callback, with result -1, before it
+ * returns, and requests queued from those callbacks are refused.
+ */
+typedef struct property_async property_async;
+
+typedef void (*property_async_fn)(const char *key, const char *value,
+                                  int result, void *cookie);
+
+property_async *property_async_open(void);
+
+int property_async_get(property_async *pa, const char *key,
+                       property_async_fn fn, void *cookie);
+
+int property_async_set(property_async *pa, const char *key, const char *value,
+                       property_async_fn fn, void *cookie);
+
+int property_async_fd(const property_async *pa);
+
+int property_async_events(const property_async *pa);
+
+int property_async_dispatch(property_async *pa);
+
+int property_async_wait(property_async *pa, int timeout_ms);
+
+void property_async_close(property_async *pa);
+
+/*
+ * Block until key is set to expected, or if expected is NULL until key
+ * changes at all.  timeout_ms of -1 waits forever.  Returns 0 once the
+ * condition holds, -1 on timeout or error.
+ */
+int property_wait(const char *key, const char *expected, int timeout_ms);
+
+/*
+ * Call fn from a background thread each time key changes.  A removed
+ * property is reported with an empty value.  If the server restarts, the
+ * watch is registered again once it's back.  Returns 0 on success.
+ */
+typedef void (*property_watch_fn)(const char *key, const char *value, void *cookie);
+
+int property_watch(const char *key, property_watch_fn fn, void *cookie);
+
+/*
+ * Call propfn for every property, or for every property whose key starts
+ * with prefix.  Returns 0 on success, -1 on error.
+ */
+int property_list(void (*propfn)(const char *key, const char *value, void *cookie), void *cookie);
+
+int property_list_prefix(const char *prefix,
+                         void (*propfn)(const char *key, const char *value, void *cookie),
+                         void *cookie);
+
+/*
+ * Call fn for each of the most recent changes propd has recorded (up to
+ * a few hundred), oldest first.  old_value is NULL if the property was
+ * created and new_value is NULL if it was removed; both are truncated to
+ * PROPERTY_VALUE_MAX - 1 bytes.  pid is the process whose connection made
+ * the change, or propd's own for changes init made itself.  time_ns is
+ * CLOCK_MONOTONIC.  Returns 0 on success, -1 on error.
+ */
+typedef struct property_change {
+    unsigned long long time_ns;
+    int pid;
+    const char *key;
+    const char *old_value;
+    const char *new_value;
+} property_change;
+
+int property_history(void (*fn)(const property_change *change, void *cookie),
+                     void *cookie);
  
+#ifndef SYSTEM_PROPERTY_PIPE_NAME
 #define SYSTEM_PROPERTY_PIPE_NAME       "/tmp/linux-sysprop"
-#define SYSTEM_PROPERTY_LIST_NAME       "/tmp/linux-sysprop-list"
+#endif
 
 enum {
     kSystemPropertyUnknown = 0,
     kSystemPropertyGet,
     kSystemPropertySet,
-    kSystemPropertyList
+    kSystemPropertyList,
+    kSystemPropertyGetMany,
+    kSystemPropertySetMany,
+    kSystemPropertyWatch,
+    kSystemPropertyNotify,
+    kSystemPropertyHello,
+    kSystemPropertyGetV2,
+    kSystemPropertySetV2,
+    kSystemPropertyHistory,
+    kSystemPropertyCommit,
+    kSystemPropertyRing
 };
 
 #ifdef __cplusplus